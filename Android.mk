@@ -16,7 +16,13 @@ LOCAL_SRC_FILES := \
 	sanity.c \
 	keystore.c \
 	asn1.c \
-	hashes.c
+	hashes.c \
+	imgwriter.c \
+	manifest.c \
+	decompress.c \
+	stats.c \
+	blkio.c \
+	erasejob.c
 
 LOCAL_CFLAGS := -DDEVICE_NAME=\"$(TARGET_BOOTLOADER_BOARD_NAME)\" \
 	-W -Wall -Wextra -Wno-unused-parameter -Wno-format-zero-length -Werror
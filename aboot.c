@@ -68,9 +68,15 @@
 #include "gpt.h"
 #include "mbr.h"
 #include "network.h"
+#include "manifest.h"
 #include "sanity.h"
 #include "keystore.h"
 #include "hashes.h"
+#include "imgwriter.h"
+#include "decompress.h"
+#include "stats.h"
+#include "blkio.h"
+#include "erasejob.h"
 
 /* Generated by the makefile, this function defines the
  * register_userfastboot_plugins() function, which calls all the
@@ -159,6 +165,8 @@ struct flash_target {
 struct cmd_struct {
 	void *callback;
 	enum device_state min_state;
+	bool keeps_hashes;	/* doesn't write to block devices */
+	bool off_storage;	/* doesn't touch them at all */
 };
 
 Hashmap *flash_cmds;
@@ -556,7 +564,11 @@ static int set_device_state(enum device_state device_state)
 		pr_status("Userdata erase required, this can take a while...\n");
 		fastboot_info("Userdata erase required, this can take a while...\n");
 
-		if (erase_partition(vol)) {
+		/* The state must not change before data is gone, this one
+		 * can't be left to the background */
+		image_hash_forget(vol->blk_device);
+		if (erase_job_start(vol, "data") ||
+				erase_job_wait(vol->blk_device)) {
 			pr_error("couldn't erase data partition\n");
 			return -1;
 		}
@@ -653,6 +665,8 @@ static int aboot_register_cmd(Hashmap *map, char *key, void *callback,
 	cs = xmalloc(sizeof(*cs));
 	cs->callback = callback;
 	cs->min_state = min_state;
+	cs->keeps_hashes = false;
+	cs->off_storage = false;
 
 	hashmapPut(map, k, cs);
 	pr_verbose("Registered plugin function %p (%s) with table %p\n",
@@ -672,6 +686,34 @@ int aboot_register_oem_cmd(char *key, oem_func callback, enum device_state min_s
 	return aboot_register_cmd(oem_cmds, key, callback, min_state);
 }
 
+/* For our own OEM commands that never write to a block device, so the
+ * image hashes survive them. Those that don't read or flush one either
+ * don't need to wait for background erases. */
+static void register_oem_query(char *key, oem_func callback,
+		enum device_state min_state, bool uses_storage)
+{
+	struct cmd_struct *cs;
+
+	if (aboot_register_oem_cmd(key, callback, min_state))
+		return;
+	cs = hashmapGet(oem_cmds, key);
+	cs->keeps_hashes = true;
+	cs->off_storage = !uses_storage;
+}
+
+/* For our own flash targets that only write through nested commands,
+ * which forget the hashes of what they overwrite themselves */
+static void register_flash_nested(char *key, flash_func callback,
+		enum device_state min_state)
+{
+	struct cmd_struct *cs;
+
+	if (aboot_register_flash_cmd(key, callback, min_state))
+		return;
+	cs = hashmapGet(flash_cmds, key);
+	cs->keeps_hashes = true;
+}
+
 
 static int set_keystore_data(void *data, unsigned sz)
 {
@@ -702,12 +744,25 @@ static int set_keystore_data(void *data, unsigned sz)
 }
 
 
+/* See oem async-erase */
+static bool async_erase;
+
+#define MAX_ERASE_TARGETS	16
+
 /* Erase a named partition by creating a new empty partition on top of
- * its device node. No parameters. */
-static void cmd_erase(char *part_name, int fd, void *data, unsigned sz)
+ * its device node. No parameters. A comma-separated list of partitions
+ * may be given, which are erased concurrently. With async-erase on, the
+ * erases run in the background and OKAY is sent right away, see
+ * erasejob.h. */
+static void cmd_erase(char *arg, int fd, void *data, unsigned sz)
 {
-	struct fstab_rec *vol;
+	struct fstab_rec *vols[MAX_ERASE_TARGETS];
+	char *names[MAX_ERASE_TARGETS];
+	const char *devices[MAX_ERASE_TARGETS];
 	enum device_state current_state;
+	char *list, *name, *saveptr, *failed;
+	bool keystore = false;
+	int i, count = 0;
 
 	current_state = get_device_state();
 	if (current_state == LOCKED) {
@@ -715,32 +770,273 @@ static void cmd_erase(char *part_name, int fd, void *data, unsigned sz)
 		return;
 	}
 
-	if (current_state == VERIFIED &&
-			!hashmapContainsKey(erase_whitelist, part_name)) {
-		fastboot_fail("can't erase this in 'verified' state");
-		return;
+	/* Check them all before erasing any */
+	list = xstrdup(arg);
+	for (name = strtok_r(list, ",", &saveptr); name;
+			name = strtok_r(NULL, ",", &saveptr)) {
+		if (current_state == VERIFIED &&
+				!hashmapContainsKey(erase_whitelist, name)) {
+			fastboot_fail("can't erase %s in 'verified' state",
+					name);
+			goto out;
+		}
+
+		if (!strcmp(name, "keystore")) {
+			keystore = true;
+			continue;
+		}
+
+		if (count == MAX_ERASE_TARGETS) {
+			fastboot_fail("too many partitions");
+			goto out;
+		}
+		vols[count] = volume_for_name(name);
+		if (vols[count] == NULL) {
+			fastboot_fail("unknown partition name %s", name);
+			goto out;
+		}
+		devices[count] = vols[count]->blk_device;
+		names[count++] = name;
 	}
 
-	if (!strcmp(part_name, "keystore")) {
-		if (set_keystore_data(NULL, 0))
-			fastboot_fail("couldn't erase keystore");
-		else
-			fastboot_okay("");
-		return;
+	/* The jobs are started before anything else is touched. A FAIL
+	 * covers those already going, so it only goes out once they are
+	 * done. */
+	for (i = 0; i < count; i++) {
+		image_hash_forget(vols[i]->blk_device);
+		if (erase_job_start(vols[i], names[i]))
+			break;
+	}
+	if (i < count) {
+		erase_job_wait_devices(devices, i, NULL);
+		fastboot_fail("Can't start erasing %s", names[i]);
+		goto out;
 	}
 
-	vol = volume_for_name(part_name);
-	if (vol == NULL) {
-		fastboot_fail("unknown partition name");
-		return;
+	if (keystore && set_keystore_data(NULL, 0)) {
+		erase_job_wait_devices(devices, count, NULL);
+		fastboot_fail("couldn't erase keystore");
+		goto out;
 	}
 
-	pr_status("Erasing %s, this can take a while...\n", part_name);
-	if (erase_partition(vol))
-		fastboot_fail("Can't erase partition");
-	else
+	if (async_erase) {
+		pr_status("Erasing %s in the background\n", arg);
 		fastboot_okay("");
+		goto out;
+	}
+
+	/* Background erases of other partitions keep going */
+	pr_status("Erasing %s, this can take a while...\n", arg);
+	if (erase_job_wait_devices(devices, count, &failed)) {
+		fastboot_fail("Can't erase %s", failed);
+		free(failed);
+	} else {
+		fastboot_okay("");
+	}
+out:
+	free(list);
+}
+
+/* Look up the recovery.fstab entry for a flash target and check that it
+ * may be written in the current device state. Calls fastboot_fail() and
+ * returns NULL if not. */
+static struct fstab_rec *flash_target_volume(struct flash_target *tgt,
+		enum device_state current_state, uint64_t *vsize)
+{
+	struct fstab_rec *vol;
+
+	if (current_state == LOCKED) {
+		fastboot_fail("Bootloader must not be locked");
+		return NULL;
+	}
+
+	if (current_state == VERIFIED &&
+			!hashmapContainsKey(flash_whitelist, tgt->name)) {
+		fastboot_fail("can't flash this partition in VERIFIED state");
+		return NULL;
+	}
+
+	vol = volume_for_name(tgt->name);
+	if (!vol) {
+		fastboot_fail("%s", tgt->name);
+		return NULL;
+	}
+
+	if (!is_valid_blkdev(vol->blk_device)) {
+		fastboot_fail("invalid destination node. partition disks?");
+		return NULL;
+	}
+	if (erase_job_wait(vol->blk_device)) {
+		fastboot_fail("background erase of %s failed", tgt->name);
+		return NULL;
+	}
+	if (get_volume_size(vol, vsize)) {
+		fastboot_fail("couldn't get volume size");
+		return NULL;
+	}
+	return vol;
+}
+
+/* How a partition target gets written, from the io=<mode> parameter.
+ * Writeback is the default: it keeps the amount of dirty page cache
+ * bounded, which matters with the little RAM we run in, without the
+ * alignment constraints of direct I/O. Direct I/O skips the search for
+ * runs of zeroes the other modes do. The delta flag only writes the
+ * blocks which differ from what the partition already holds, the
+ * discard flag discards the regions a sparse image leaves untouched and
+ * verify reads everything back from the device as it is written. crc
+ * checks the CRC32 chunks a sparse image may contain. */
+struct flash_opts {
+	enum blkio_mode mode;
+	unsigned flags;
+	bool check_crc;
+};
+
+static int target_io_opts(struct flash_target *tgt, struct flash_opts *opts)
+{
+	char *str = hashmapGet(tgt->params, "io");
+
+	opts->mode = BLKIO_WRITEBACK;
+	if (str && blkio_parse_mode(str, &opts->mode)) {
+		fastboot_fail("io must be buffered, writeback or direct");
+		return -1;
+	}
+	/* Long runs of zeroes are cheaper to discard or zero out, but
+	 * looking for them takes direct I/O off native AIO */
+	opts->flags = 0;
+	if (opts->mode != BLKIO_DIRECT)
+		opts->flags |= BLKIO_ZERO_DETECT;
+	if (hashmapContainsKey(tgt->params, "delta"))
+		opts->flags |= BLKIO_DELTA;
+	if (hashmapContainsKey(tgt->params, "discard"))
+		opts->flags |= BLKIO_DISCARD;
+	if (hashmapContainsKey(tgt->params, "verify"))
+		opts->flags |= BLKIO_VERIFY;
+	opts->check_crc = hashmapContainsKey(tgt->params, "crc");
+	return 0;
+}
+
+/* Batch mode: partitions are not flushed one by one after they are
+ * flashed, but all together by "oem batch commit" or before rebooting.
+ * Maps the device nodes waiting for a flush to nothing. */
+static bool batch_mode;
+static Hashmap *batch_devices;
+
+static bool flush_device(void *key, void *value, void *context)
+{
+	int *ret = context;
+	int fd;
+
+	pr_verbose("flushing %s\n", (char *)key);
+	fd = open(key, O_WRONLY);
+	if (fd < 0 || fdatasync(fd)) {
+		pr_error("couldn't flush %s: %s\n", (char *)key,
+				strerror(errno));
+		*ret = -1;
+	}
+	if (fd >= 0)
+		close(fd);
+	free(key);
+	return true;
+}
+
+static int batch_commit(void)
+{
+	int ret = 0;
+
+	if (!batch_devices)
+		return 0;
+	hashmapForEach(batch_devices, flush_device, &ret);
+	hashmapFree(batch_devices);
+	batch_devices = NULL;
+	return ret;
+}
+
+/* An image being written to a partition, and hashed on the way */
+struct image_target {
+	struct imgwriter *w;
+	struct image_hash *hash;
+	const char *name;
+	const char *device;
+};
+
+static int start_image(struct image_target *img, const char *name,
+		struct fstab_rec *vol, uint64_t vsize, struct flash_opts *opts)
+{
+	img->w = imgwriter_open(vol->blk_device, vsize, opts->mode,
+			opts->flags);
+	if (!img->w)
+		return -1;
+	if (opts->check_crc)
+		imgwriter_check_crc(img->w);
+	img->hash = image_hash_new();
+	imgwriter_set_hash(img->w, img->hash);
+	img->name = name;
+	img->device = vol->blk_device;
+	return 0;
+}
+
+/* Close the image writer, flushing the device unless in batch mode, and
+ * record the image hashes if it was all written. ret is the outcome of
+ * feeding the image in. */
+static int finish_image(struct image_target *img, int ret)
+{
+	if (imgwriter_close(img->w, !batch_mode))
+		ret = -1;
+	if (ret) {
+		image_hash_free(img->hash);
+		image_hash_forget(img->device);
+		return -1;
+	}
+	image_hash_commit(img->hash, img->name, img->device);
+	if (!batch_mode)
+		return 0;
+
+	if (!batch_devices)
+		batch_devices = hashmapCreate(8, strhash, strcompare);
+	if (!batch_devices)
+		die();
+	if (!hashmapContainsKey(batch_devices, (void *)img->device))
+		hashmapPut(batch_devices, xstrdup(img->device), NULL);
+	return 0;
+}
+
+/* Raw and sparse images are both written in a single pass over the
+ * data, sparse chunks being decoded as they are reached. For raw images
+ * the progress bar follows what has actually reached the device; sparse
+ * ones expand to an unknown amount of writes, so there it follows the
+ * input. */
+static int write_image_buffer(const char *name, struct fstab_rec *vol,
+		uint64_t vsize, struct flash_opts *opts, void *data, unsigned sz)
+{
+	struct image_target img;
+	unsigned char *pos = data;
+	unsigned left = sz;
+	uint32_t magic = 0;
+	float done;
+	int ret = 0;
+
+	if (start_image(&img, name, vol, vsize, opts))
+		return -1;
+	if (sz >= sizeof(magic))
+		memcpy(&magic, data, sizeof(magic));
 
+	mui_show_progress(1.0, 0);
+	while (left && !ret) {
+		unsigned n = min(left, (unsigned)BLKIO_BUF_SIZE);
+
+		ret = imgwriter_write(img.w, pos, n);
+		pos += n;
+		left -= n;
+		if (magic == SPARSE_HEADER_MAGIC)
+			done = sz - left;
+		else
+			done = min((uint64_t)sz, imgwriter_bytes_done(img.w));
+		mui_set_progress(done / (float)sz);
+	}
+	ret = finish_image(&img, ret);
+	mui_reset_progress();
+	return ret;
 }
 
 /* Image command. Allows user to send a single file which
@@ -758,6 +1054,10 @@ static void cmd_erase(char *part_name, int fd, void *data, unsigned sz)
  * delimited from the target name by a colon. Each parameter is either
  * a simple string (for flags) or param=value.
  *
+ * Partitions accept io=buffered|writeback|direct to choose how the image
+ * is written, and a delta flag to skip blocks which are already up to
+ * date, see target_io_opts().
+ *
  */
 static void cmd_flash(char *targetspec, int fd, void *data, unsigned sz)
 {
@@ -769,6 +1069,7 @@ static void cmd_flash(char *targetspec, int fd, void *data, unsigned sz)
 	uint64_t vsize;
 	uint32_t magic = 0;
 	enum device_state current_state;
+	struct flash_opts opts;
 
 	process_target(targetspec, &tgt);
 
@@ -788,8 +1089,15 @@ static void cmd_flash(char *targetspec, int fd, void *data, unsigned sz)
 		}
 
 		cb = (flash_func)cs->callback;
+		if (erase_job_wait(NULL)) {
+			fastboot_fail("background erase failed");
+			goto out;
+		}
 
 		cbret = cb(tgt.params, fd, data, sz);
+		/* No telling which partitions a plugin touched */
+		if (!cs->keeps_hashes)
+			image_hash_forget(NULL);
 		if (cbret) {
 			pr_error("%s flash failed!\n", tgt.name);
 			fastboot_fail("%s", tgt.name);
@@ -798,49 +1106,32 @@ static void cmd_flash(char *targetspec, int fd, void *data, unsigned sz)
 		goto out;
 	}
 
-	if (current_state == LOCKED) {
-		fastboot_fail("Bootloader must not be locked");
-		goto out;
-	}
-
-	if (current_state == VERIFIED &&
-			!hashmapContainsKey(flash_whitelist, tgt.name)) {
-		fastboot_fail("can't flash this partition in VERIFIED state");
-		goto out;
-	}
-
-	vol = volume_for_name(tgt.name);
-	if (!vol) {
-		fastboot_fail("%s", tgt.name);
+	vol = flash_target_volume(&tgt, current_state, &vsize);
+	if (!vol || target_io_opts(&tgt, &opts))
 		goto out;
-	}
-
-	if (!is_valid_blkdev(vol->blk_device)) {
-		fastboot_fail("invalid destination node. partition disks?");
-		goto out;
-	}
-	if (get_volume_size(vol, &vsize)) {
-		fastboot_fail("couldn't get volume size");
-		goto out;
-	}
 
-	if (!strcmp(targetspec, "fastboot") ||
-	    !strcmp(targetspec, "recovery") ||
-	    !strcmp(targetspec, "boot")) {
+	if (!strcmp(tgt.name, "fastboot") ||
+	    !strcmp(tgt.name, "recovery") ||
+	    !strcmp(tgt.name, "boot")) {
 		if (bootimage_sanity_checks(data, sz)) {
 			fastboot_fail("malformed AOSP boot image, refusing to flash!");
 			goto out;
 		}
 	}
 
-	if (!strcmp(targetspec, "bootloader")) {
-		if (esp_sanity_checks(FASTBOOT_DOWNLOAD_TMP_FILE)) {
+	if (!strcmp(tgt.name, "bootloader")) {
+		/* The ESP check loopback mounts the image by name */
+		if (!fastboot_download_path()) {
+			fastboot_fail("bootloader must be downloaded on its own");
+			goto out;
+		}
+		if (esp_sanity_checks(fastboot_download_path())) {
 			fastboot_fail("malformed bootloader image");
 			goto out;
 		}
 	}
 
-	pr_debug("target '%s' volume size: %" PRIu64 " MiB\n", targetspec, vsize >> 20);
+	pr_debug("target '%s' volume size: %" PRIu64 " MiB\n", tgt.name, vsize >> 20);
 
 	if (sz >= sizeof(magic))
 		memcpy(&magic, data, sizeof(magic));
@@ -859,7 +1150,6 @@ static void cmd_flash(char *targetspec, int fd, void *data, unsigned sz)
 			fastboot_fail("target partition too small!");
 			goto out;
 		}
-		ret = named_file_write_ext4_sparse(vol->blk_device, FASTBOOT_DOWNLOAD_TMP_FILE);
 	} else {
 		if (sz > vsize) {
 			pr_error("need %d, %" PRIu64 " available\n",
@@ -868,14 +1158,13 @@ static void cmd_flash(char *targetspec, int fd, void *data, unsigned sz)
 			goto out;
 		}
 		pr_debug("Writing %u MiB to %s\n", sz >> 20, vol->blk_device);
-		ret = named_file_write(vol->blk_device, data, sz, 0, 0);
 	}
+	ret = write_image_buffer(tgt.name, vol, vsize, &opts, data, sz);
 	pr_verbose("Done writing image\n");
 	if (ret) {
 		fastboot_fail("Can't write data to target device");
 		goto out;
 	}
-	sync();
 
 	pr_debug("wrote %u bytes to %s\n", sz, vol->blk_device);
 
@@ -884,6 +1173,104 @@ out:
 	hashmapFree(tgt.params);
 }
 
+static int stream_to_imgwriter(const void *buf, size_t len, void *context)
+{
+	return imgwriter_write(context, buf, len);
+}
+
+static int stream_to_decompressor(const void *buf, size_t len, void *context)
+{
+	return decompressor_write(context, buf, len);
+}
+
+/* Download and flash in one step. The payload is written to the target
+ * partition while it is still being received instead of being staged in
+ * /tmp first, so flashing takes about as long as the slower of the
+ * transfer and the disk writes rather than their sum. Raw and sparse
+ * images are both accepted.
+ *
+ * download-flash:<size in hex>:<targetspec>
+ *
+ * A compressed image can be sent by adding a compress=<format> parameter
+ * to the targetspec, with one of the formats in the download-compression
+ * variable. It is then expanded on the fly before it is written.
+ *
+ * As with flash, io=buffered|writeback|direct selects how the partition
+ * is written, delta only rewrites the blocks that changed and crc checks
+ * sparse image CRCs.
+ *
+ * Only partitions listed in recovery.fstab can be streamed to. Plugin
+ * flash targets, and images which are sanity checked as a whole before
+ * they are written, still need a regular download followed by flash.
+ */
+static void cmd_download_flash(char *arg, int fd, void *data, unsigned sz)
+{
+	struct flash_target tgt;
+	struct fstab_rec *vol;
+	struct decompressor *d;
+	const char *format;
+	struct image_target img;
+	struct flash_opts opts;
+	uint64_t vsize;
+	unsigned len;
+	char *end;
+	int ret;
+
+	len = strtoul(arg, &end, 16);
+	if (end == arg || *end != ':') {
+		fastboot_fail("usage: download-flash:<size>:<target>");
+		return;
+	}
+
+	process_target(end + 1, &tgt);
+	pr_status("Flashing %s\n", tgt.name);
+
+	if (hashmapGet(flash_cmds, tgt.name) ||
+	    !strcmp(tgt.name, "fastboot") ||
+	    !strcmp(tgt.name, "recovery") ||
+	    !strcmp(tgt.name, "boot") ||
+	    !strcmp(tgt.name, "bootloader")) {
+		fastboot_fail("%s can't be streamed", tgt.name);
+		goto out;
+	}
+
+	vol = flash_target_volume(&tgt, get_device_state(), &vsize);
+	if (!vol || target_io_opts(&tgt, &opts))
+		goto out;
+
+	if (start_image(&img, tgt.name, vol, vsize, &opts)) {
+		fastboot_fail("couldn't open target device");
+		goto out;
+	}
+
+	format = hashmapGet(tgt.params, "compress");
+	if (format) {
+		d = decompressor_open(format, stream_to_imgwriter, img.w);
+		if (!d) {
+			finish_image(&img, -1);
+			fastboot_fail("unsupported compression");
+			goto out;
+		}
+		ret = fastboot_download_stream(len, stream_to_decompressor, d);
+		if (decompressor_close(d) && !ret)
+			ret = 1;
+	} else
+		ret = fastboot_download_stream(len, stream_to_imgwriter,
+				img.w);
+	if (finish_image(&img, ret) && !ret)
+		ret = 1;
+	if (ret < 0)
+		goto out;
+	if (ret) {
+		fastboot_fail("Can't write data to target device");
+		goto out;
+	}
+
+	fastboot_okay("");
+out:
+	hashmapFree(tgt.params);
+}
+
 static int parse_state_cmd(char *cmd, enum device_state *state)
 {
 	if (!strcmp(cmd, CMD_UNLOCK)) {
@@ -952,7 +1339,16 @@ static void cmd_oem(char *arg, int fd, void *data, unsigned sz)
 		goto out;
 	}
 
+	/* No telling what they touch */
+	if (!cs->off_storage && erase_job_wait(NULL)) {
+		fastboot_fail("background erase failed");
+		goto out;
+	}
+
 	ret = ((oem_func)cs->callback)(argc, argv);
+	/* No telling which partitions a plugin touched */
+	if (!cs->keeps_hashes)
+		image_hash_forget(NULL);
 	if (ret) {
 		pr_error("oem %s command failed, retval = %d\n",
 				argv[0], ret);
@@ -976,6 +1372,10 @@ static void cmd_boot(char *arg, int fd, void *data, unsigned sz)
 		return;
 	}
 
+	if (erase_job_wait(NULL)) {
+		fastboot_fail("background erase failed");
+		return;
+	}
 	pr_status("Preparing boot image");
 	if (copy_bootloader_file("bootonce.img", data, sz)) {
 		fastboot_fail("couldn't stage boot image");
@@ -1247,10 +1647,13 @@ static int cmd_flash_keystore(Hashmap *params, int fd, void *data,
 }
 
 
+/* android_reboot() syncs everything by itself, only batched flushes and
+ * background erases need to be done first */
 static void cmd_reboot(char *arg, int fd, void *data, unsigned sz)
 {
+	erase_job_wait(NULL);
 	fastboot_okay("");
-	sync();
+	batch_commit();
 	close_iofds();
 	pr_info("Rebooting!\n");
 	android_reboot(ANDROID_RB_RESTART, 0, 0);
@@ -1260,8 +1663,9 @@ static void cmd_reboot(char *arg, int fd, void *data, unsigned sz)
 
 static void cmd_reboot_bl(char *arg, int fd, void *data, unsigned sz)
 {
+	erase_job_wait(NULL);
 	fastboot_okay("");
-	sync();
+	batch_commit();
 	close_iofds();
 	pr_info("Restarting UserFastBoot...\n");
 	android_reboot(ANDROID_RB_RESTART2, 0, "bootloader");
@@ -1269,7 +1673,7 @@ static void cmd_reboot_bl(char *arg, int fd, void *data, unsigned sz)
 }
 
 
-#define CHUNK	1024LL * 1024LL
+#define CHUNK	((int64_t)BLKIO_BUF_SIZE)
 static int garbage_disk(int argc, char **argv)
 {
 	char disk_path[PATH_MAX];
@@ -1278,6 +1682,7 @@ static int garbage_disk(int argc, char **argv)
 	int ofd = -1;
 	char *buf = NULL;
 	int64_t remaining_disk, disk_size;
+	struct blkio *io;
 	int ret = -1;
 
 	if (argc == 2)
@@ -1314,19 +1719,23 @@ static int garbage_disk(int argc, char **argv)
 		goto out;
 	}
 
+	image_hash_forget(NULL);
 	mui_show_progress(1.0, 0);
+	io = blkio_open(ofd, 0);
 	while (remaining_disk) {
-		ssize_t written, to_write;
+		int64_t to_write;
 
 		mui_set_progress((float)(disk_size - remaining_disk) / (float)disk_size);
 
-		to_write = (CHUNK > disk_size) ? disk_size : CHUNK;
-		written = robust_write(ofd, buf, to_write);
-		if (written < 0) {
-			pr_error("couldn't write to the disk\n");
-			goto out;
-		}
-		remaining_disk -= written;
+		to_write = min(remaining_disk, CHUNK);
+		if (blkio_write_external(io, buf, to_write,
+					disk_size - remaining_disk))
+			break;
+		remaining_disk -= to_write;
+	}
+	if (blkio_close(io, false)) {
+		pr_error("couldn't write to the disk\n");
+		goto out;
 	}
 	ret = 0;
 out:
@@ -1443,6 +1852,7 @@ static int oem_reboot_cmd(int argc, char **argv)
 
 	pr_info("Rebooting into %s...\n", argv[1]);
 	fastboot_okay("");
+	batch_commit();
 	close_iofds();
 	android_reboot(ANDROID_RB_RESTART2, 0, argv[1]);
 	/* Shouldn't get here */
@@ -1465,6 +1875,63 @@ static int oem_showtext(int argc, char **argv)
 }
 
 
+static int oem_stats_reset(int argc, char **argv)
+{
+	stats_reset();
+	return 0;
+}
+
+
+static int oem_blkio_depth(int argc, char **argv)
+{
+	if (argc != 2) {
+		pr_error("usage: oem blkio-depth <writes in flight>\n");
+		return -1;
+	}
+	blkio_set_default_depth(strtoul(argv[1], NULL, 0));
+	fastboot_publish("blkio-depth",
+			xasprintf("%u", blkio_get_default_depth()));
+	return 0;
+}
+
+
+/* oem batch start: stop flushing each partition as soon as it's flashed
+ * oem batch commit: flush them all and leave batch mode */
+static int oem_batch(int argc, char **argv)
+{
+	int ret = 0;
+
+	if (argc == 2 && !strcmp(argv[1], "start")) {
+		batch_mode = true;
+	} else if (argc == 2 && !strcmp(argv[1], "commit")) {
+		batch_mode = false;
+		ret = batch_commit();
+	} else {
+		pr_error("usage: oem batch start|commit\n");
+		return -1;
+	}
+	fastboot_publish("batch", xstrdup(batch_mode ? "yes" : "no"));
+	return ret;
+}
+
+
+/* oem async-erase on|off: have erase commands return before the erase
+ * is done */
+static int oem_async_erase(int argc, char **argv)
+{
+	if (argc == 2 && !strcmp(argv[1], "on")) {
+		async_erase = true;
+	} else if (argc == 2 && !strcmp(argv[1], "off")) {
+		async_erase = false;
+	} else {
+		pr_error("usage: oem async-erase on|off\n");
+		return -1;
+	}
+	fastboot_publish("async-erase", xstrdup(async_erase ? "yes" : "no"));
+	return 0;
+}
+
+
 static int oem_get_hashes(int argc, char **argv)
 {
 	int ret = 0;
@@ -1489,13 +1956,31 @@ static void publish_from_prop(char *key, char *prop, char *dfl)
 }
 
 
+static char *status_vars[] = {
+	"product",
+	"version-bootloader",
+	"kernel",
+	"firmware",
+	"board",
+	"serialno",
+	"device-state",
+	"secureboot",
+	"boot-state",
+	"provisioning-mode",
+};
+#define STATUS_VARS	(sizeof(status_vars) / sizeof(*status_vars))
+
 void populate_status_info(void)
 {
 	char *interface_info;
 	char *infostring;
+	char *v[STATUS_VARS];
+	size_t i;
 
 	pr_debug("updating status text\n");
 	interface_info = get_network_interface_status();
+	for (i = 0; i < STATUS_VARS; i++)
+		v[i] = fastboot_getvar(status_vars[i]);
 
 	infostring = xasprintf("Userfastboot for %s\n \n"
 		     "       bootloader: %s\n"
@@ -1508,20 +1993,13 @@ void populate_status_info(void)
 		     "       boot state: %s\n"
 		     "provisioning mode: %s\n"
 		     " \n%s",
-		     fastboot_getvar("product"),
-		     fastboot_getvar("version-bootloader"),
-		     fastboot_getvar("kernel"),
-		     fastboot_getvar("firmware"),
-		     fastboot_getvar("board"),
-		     fastboot_getvar("serialno"),
-		     fastboot_getvar("device-state"),
-		     fastboot_getvar("secureboot"),
-		     fastboot_getvar("boot-state"),
-		     fastboot_getvar("provisioning-mode"),
+		     v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8], v[9],
 		     interface_info);
 	pr_debug("%s", infostring);
 	mui_infotext(infostring);
 	free(infostring);
+	for (i = 0; i < STATUS_VARS; i++)
+		free(v[i]);
 }
 
 
@@ -1653,6 +2131,7 @@ void aboot_register_commands(void)
 	fastboot_register("boot", cmd_boot);
 	fastboot_register("erase:", cmd_erase);
 	fastboot_register("flash:", cmd_flash);
+	fastboot_register("download-flash:", cmd_download_flash);
 
 	aboot_register_flash_cmd("gpt", cmd_flash_gpt, UNLOCKED);
 	aboot_register_flash_cmd("mbr", cmd_flash_mbr, UNLOCKED);
@@ -1661,15 +2140,23 @@ void aboot_register_commands(void)
 	aboot_register_flash_cmd("oemvars", cmd_flash_oemvars, UNLOCKED);
 	aboot_register_flash_cmd("keystore", cmd_flash_keystore, UNLOCKED);
 	aboot_register_flash_cmd("efirun", cmd_flash_efirun, UNLOCKED);
+	register_flash_nested("manifest", cmd_flash_manifest, UNLOCKED);
 
 	aboot_register_oem_cmd("garbage-disk", garbage_disk, UNLOCKED);
 	aboot_register_oem_cmd("setvar", set_efi_var, UNLOCKED);
 	aboot_register_oem_cmd("reboot", oem_reboot_cmd, LOCKED);
-	aboot_register_oem_cmd("showtext", oem_showtext, LOCKED);
-	aboot_register_oem_cmd("hidetext", oem_hidetext, LOCKED);
+	register_oem_query("showtext", oem_showtext, LOCKED, false);
+	register_oem_query("hidetext", oem_hidetext, LOCKED, false);
+	register_oem_query("stats-reset", oem_stats_reset, LOCKED, false);
+	register_oem_query("blkio-depth", oem_blkio_depth, LOCKED, false);
+	fastboot_publish("blkio-depth", xasprintf("%u", blkio_get_default_depth()));
+	register_oem_query("batch", oem_batch, LOCKED, true);
+	fastboot_publish("batch", xstrdup("no"));
+	register_oem_query("async-erase", oem_async_erase, LOCKED, false);
+	fastboot_publish("async-erase", xstrdup("no"));
 	aboot_register_oem_cmd("off-mode-charge", oem_off_mode_charge, UNLOCKED);
 	aboot_register_oem_cmd("provisioning-done", oem_provisioning_done, LOCKED);
-	aboot_register_oem_cmd("get-hashes", oem_get_hashes, LOCKED);
+	register_oem_query("get-hashes", oem_get_hashes, LOCKED, true);
 
 	register_userfastboot_plugins();
 
@@ -0,0 +1,1107 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "blkio.h"
+#include "userfastboot_aio.h"
+#include "userfastboot_ui.h"
+#include "userfastboot_util.h"
+
+#define BLKIO_DEFAULT_DEPTH	4
+#define BLKIO_MAX_DEPTH		32
+
+/* Writeback mode: dirty data allowed before waiting for the oldest
+ * writes to reach the device */
+#define BLKIO_WB_WINDOW		(16 * 1024 * 1024)
+#define BLKIO_WB_RANGES		64
+
+/* BLKIO_ZERO_DETECT: shorter runs of zeroes are just written */
+#define BLKIO_ZERO_MIN		(64 * 1024)
+
+/* blkio_zero_fill(): BLKZEROOUT chunk when the kernel doesn't say how
+ * much the device takes at once */
+#define BLKIO_ZEROOUT_CHUNK	(256 * 1024 * 1024)
+
+/* How blkio_zero() gets zeroes onto the device, best first. Each one
+ * that fails is not tried again for the same descriptor. */
+enum zero_method {
+	ZERO_DISCARD,
+	ZERO_ZEROOUT,
+	ZERO_PUNCH_HOLE,
+	ZERO_WRITE,
+};
+
+struct wb_range {
+	uint64_t offset;
+	size_t len;
+	bool done;		/* the write completed */
+};
+
+struct blkio_req {
+	const void *data;	/* NULL to zero or discard the range */
+	size_t len;
+	uint64_t offset;
+	bool owned;		/* data came from blkio_get_buffer() */
+	bool discard;
+	bool wb;		/* tracked in io->wb[wb_slot] */
+	unsigned wb_slot;
+	struct iocb cb;
+};
+
+struct blkio {
+	int fd;
+	int vfd;		/* BLKIO_VERIFY reads */
+	unsigned char *vbuf;	/* for verifying unaligned writes */
+	unsigned depth;
+	enum blkio_mode mode;
+	unsigned flags;
+	int zero_method;
+	bool use_aio;
+	aio_context_t ctx;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int error;		/* errno of the first failed write */
+
+	/* Buffer pool, grown on demand up to max_bufs */
+	void **free_bufs;
+	unsigned nfree;
+	unsigned nbufs;
+	unsigned max_bufs;
+
+	/* Requests queued or in flight. With AIO, slot i is in flight iff
+	 * busy[i]; with threads, queue[qhead..] are waiting for a worker */
+	struct blkio_req *reqs;
+	bool *busy;
+	unsigned qhead;
+	unsigned qcount;
+	unsigned pending;
+
+	pthread_t *threads;
+	unsigned nthreads;
+	bool stop;
+
+	uint64_t bytes_written;
+	uint64_t bytes_unchanged;	/* skipped by BLKIO_DELTA */
+	uint64_t bytes_zeroed;		/* by blkio_zero() or detection */
+	uint64_t bytes_discarded;
+	uint64_t bytes_verified;
+
+	/* Writeback mode: FIFO of queued writes whose flush has not been
+	 * waited for yet. The first wb_kicked of them are being flushed. */
+	struct wb_range wb[BLKIO_WB_RANGES];
+	unsigned wb_head;
+	unsigned wb_count;
+	unsigned wb_kicked;
+	size_t wb_bytes;
+	uint64_t bytes_synced;
+};
+
+static unsigned default_depth = BLKIO_DEFAULT_DEPTH;
+
+/* Never written to, but not const: that would put 1 MiB of zeroes in
+ * .rodata rather than .bss */
+static unsigned char zero_buf[BLKIO_BUF_SIZE]
+	__attribute__((aligned(BLKIO_ALIGN)));
+
+
+void blkio_set_default_depth(unsigned depth)
+{
+	default_depth = max(1U, min(depth, (unsigned)BLKIO_MAX_DEPTH));
+}
+
+
+unsigned blkio_get_default_depth(void)
+{
+	return default_depth;
+}
+
+
+static int pwrite_all(int fd, const void *buf, size_t len, uint64_t offset)
+{
+	const unsigned char *pos = buf;
+
+	while (len) {
+		ssize_t ret = pwrite64(fd, pos, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (!ret) {
+			errno = ENOSPC;
+			return -1;
+		}
+		pos += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+
+static int pread_all(int fd, void *buf, size_t len, uint64_t offset)
+{
+	unsigned char *pos = buf;
+
+	while (len) {
+		ssize_t ret = pread64(fd, pos, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (!ret) {
+			errno = EIO;
+			return -1;
+		}
+		pos += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+
+/* BLKIO_DELTA: compare the data against what the device holds, block by
+ * block, and write only the runs of blocks which differ. If the old
+ * contents can't be read everything is written. */
+static int write_delta(struct blkio *io, const unsigned char *data,
+		size_t len, uint64_t offset, unsigned char *cur)
+{
+	size_t pos, n, run = 0, skipped = 0;
+
+	if (pread_all(io->fd, cur, len, offset))
+		return pwrite_all(io->fd, data, len, offset);
+
+	for (pos = 0; ; pos += n) {
+		n = min(len - pos, (size_t)BLKIO_ALIGN);
+		if (n && memcmp(data + pos, cur + pos, n))
+			continue;
+		/* End of a run of changed blocks */
+		if (pos > run && pwrite_all(io->fd, data + run, pos - run,
+					offset + run))
+			return -1;
+		if (!n)
+			break;
+		skipped += n;
+		run = pos + n;
+	}
+	__atomic_add_fetch(&io->bytes_unchanged, skipped, __ATOMIC_RELAXED);
+	return 0;
+}
+
+
+static int write_data(struct blkio *io, const unsigned char *data,
+		size_t len, uint64_t offset, unsigned char *cur)
+{
+	if (cur)
+		return write_delta(io, data, len, offset, cur);
+	return pwrite_all(io->fd, data, len, offset);
+}
+
+
+/* Partitions keep their queue limits in the parent disk's directory */
+static int64_t read_queue_attr(int fd, const char *attr)
+{
+	struct stat sb;
+	int64_t val;
+
+	if (fstat(fd, &sb) || !S_ISBLK(sb.st_mode))
+		return -1;
+	if (!read_sysfs_int64(&val, "/sys/dev/block/%u:%u/queue/%s",
+				major(sb.st_rdev), minor(sb.st_rdev), attr) ||
+			!read_sysfs_int64(&val, "/sys/dev/block/%u:%u/../queue/%s",
+				major(sb.st_rdev), minor(sb.st_rdev), attr))
+		return val;
+	return -1;
+}
+
+
+static int zero_method(int fd)
+{
+	struct stat sb;
+
+	if (fstat(fd, &sb))
+		return ZERO_WRITE;
+	if (!S_ISBLK(sb.st_mode))
+		return ZERO_PUNCH_HOLE;
+	if (read_queue_attr(fd, "discard_zeroes_data") == 1)
+		return ZERO_DISCARD;
+	return ZERO_ZEROOUT;
+}
+
+
+static int write_zeroes(struct blkio *io, uint64_t offset, uint64_t len)
+{
+	while (len) {
+		size_t n = min(len, (uint64_t)BLKIO_BUF_SIZE);
+
+		if (pwrite_all(io->fd, zero_buf, n, offset))
+			return -1;
+		offset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+static int zero_range(struct blkio *io, uint64_t offset, uint64_t len)
+{
+	int method = __atomic_load_n(&io->zero_method, __ATOMIC_RELAXED);
+	uint64_t range[2] = { offset, len };
+	int ret = 0;
+
+	switch (method) {
+	case ZERO_DISCARD:
+		if (!ioctl(io->fd, BLKDISCARD, &range))
+			break;
+		pr_verbose("BLKDISCARD: %s, trying BLKZEROOUT\n",
+				strerror(errno));
+		method = ZERO_ZEROOUT;
+		/* fall through */
+	case ZERO_ZEROOUT:
+		if (!ioctl(io->fd, BLKZEROOUT, &range))
+			break;
+		pr_verbose("BLKZEROOUT: %s, writing zeroes\n",
+				strerror(errno));
+		method = ZERO_WRITE;
+		ret = write_zeroes(io, offset, len);
+		break;
+	case ZERO_PUNCH_HOLE:
+		/* Punching can't grow the file, the last byte makes sure it
+		 * ends up at least as long as if zeroes had been written */
+		if (!fallocate(io->fd, FALLOC_FL_PUNCH_HOLE |
+					FALLOC_FL_KEEP_SIZE, offset, len) &&
+				!fallocate(io->fd, 0, offset + len - 1, 1))
+			break;
+		pr_verbose("hole punching: %s, writing zeroes\n",
+				strerror(errno));
+		method = ZERO_WRITE;
+		/* fall through */
+	case ZERO_WRITE:
+		ret = write_zeroes(io, offset, len);
+		break;
+	}
+	__atomic_store_n(&io->zero_method, method, __ATOMIC_RELAXED);
+	if (!ret)
+		__atomic_add_fetch(&io->bytes_zeroed, len, __ATOMIC_RELAXED);
+	return ret;
+}
+
+
+/* Contents don't matter, so failures are not errors either */
+static int discard_range(struct blkio *io, uint64_t offset, uint64_t len)
+{
+	uint64_t range[2] = { offset, len };
+	struct stat sb;
+	int ret;
+
+	if (fstat(io->fd, &sb))
+		return 0;
+	if (S_ISBLK(sb.st_mode))
+		ret = ioctl(io->fd, BLKDISCARD, &range);
+	else
+		ret = fallocate(io->fd, FALLOC_FL_PUNCH_HOLE |
+				FALLOC_FL_KEEP_SIZE, offset, len);
+	if (ret)
+		pr_verbose("discard: %s\n", strerror(errno));
+	else
+		__atomic_add_fetch(&io->bytes_discarded, len,
+				__ATOMIC_RELAXED);
+	return 0;
+}
+
+
+static int zero_or_discard(struct blkio *io, struct blkio_req *req)
+{
+	if (req->discard)
+		return discard_range(io, req->offset, req->len);
+	return zero_range(io, req->offset, req->len);
+}
+
+
+static bool is_zero_block(const unsigned char *p)
+{
+	size_t i;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+
+	for (i = 0; i < BLKIO_ALIGN; i += 64) {
+		__m128i acc = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i)),
+				_mm_loadu_si128((const __m128i *)(p + i + 16))),
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i + 32)),
+				_mm_loadu_si128((const __m128i *)(p + i + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+			return false;
+	}
+#else
+	for (i = 0; i < BLKIO_ALIGN; i += sizeof(unsigned long)) {
+		unsigned long v;
+
+		memcpy(&v, p + i, sizeof(v));
+		if (v)
+			return false;
+	}
+#endif
+	return true;
+}
+
+
+/* BLKIO_ZERO_DETECT: zero runs of at least BLKIO_ZERO_MIN of whole
+ * blocks, write everything in between */
+static int write_detect_zero(struct blkio *io, const unsigned char *data,
+		size_t len, uint64_t offset, unsigned char *cur)
+{
+	size_t pos = 0, run = 0, zstart;
+
+	if (offset % BLKIO_ALIGN)
+		return write_data(io, data, len, offset, cur);
+
+	while (pos + BLKIO_ALIGN <= len) {
+		if (!is_zero_block(data + pos)) {
+			pos += BLKIO_ALIGN;
+			continue;
+		}
+		zstart = pos;
+		do
+			pos += BLKIO_ALIGN;
+		while (pos + BLKIO_ALIGN <= len && is_zero_block(data + pos));
+		if (pos - zstart < BLKIO_ZERO_MIN)
+			continue;
+
+		if (zstart > run && write_data(io, data + run, zstart - run,
+					offset + run, cur))
+			return -1;
+		if (zero_range(io, offset + zstart, pos - zstart))
+			return -1;
+		run = pos;
+	}
+	if (len > run)
+		return write_data(io, data + run, len - run, offset + run, cur);
+	return 0;
+}
+
+
+/* Read [start, start + len) into buf, which holds len rounded up to
+ * BLKIO_ALIGN. O_DIRECT wants whole blocks, so more is asked for. */
+static int read_back(struct blkio *io, unsigned char *buf, size_t len,
+		uint64_t start)
+{
+	size_t want = (len + BLKIO_ALIGN - 1) & ~(size_t)(BLKIO_ALIGN - 1);
+	size_t have = 0;
+
+	while (have < len) {
+		ssize_t ret = pread64(io->vfd, buf + have, want - have,
+				start + have);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (!ret) {
+			errno = EIO;
+			return -1;
+		}
+		have += ret;
+	}
+	return 0;
+}
+
+
+/* BLKIO_VERIFY: compare what the device now holds with the request */
+static int verify(struct blkio *io, struct blkio_req *req,
+		unsigned char *vbuf)
+{
+	const unsigned char *data = req->data;
+	uint64_t pos = 0;
+
+	while (pos < req->len) {
+		uint64_t off = req->offset + pos;
+		uint64_t start = off & ~(uint64_t)(BLKIO_ALIGN - 1);
+		size_t skip = off - start;
+		size_t n = min(req->len - pos, (uint64_t)(BLKIO_BUF_SIZE - skip));
+		const unsigned char *expect = data ? data + pos : zero_buf;
+
+		if (read_back(io, vbuf, skip + n, start)) {
+			pr_perror("verify read");
+			return -1;
+		}
+		if (memcmp(vbuf + skip, expect, n)) {
+			size_t i = 0;
+
+			while (vbuf[skip + i] == expect[i])
+				i++;
+			pr_error("verify failed at offset %llu\n",
+					(unsigned long long)(off + i));
+			errno = EIO;
+			return -1;
+		}
+		pos += n;
+	}
+	__atomic_add_fetch(&io->bytes_verified, req->len, __ATOMIC_RELAXED);
+	return 0;
+}
+
+
+/* Returns 0 or an errno value */
+static int process(struct blkio *io, struct blkio_req *req,
+		unsigned char *cur, unsigned char *vbuf)
+{
+	int ret;
+
+	/* Delta buffers only hold that much */
+	if (req->len > BLKIO_BUF_SIZE)
+		cur = NULL;
+
+	/* With BLKIO_DELTA, zero blocks are compared like any other, as
+	 * they most likely are zero on the device already */
+	if (!req->data)
+		ret = zero_or_discard(io, req);
+	else if ((io->flags & BLKIO_ZERO_DETECT) && !cur)
+		ret = write_detect_zero(io, req->data, req->len, req->offset,
+				cur);
+	else
+		ret = write_data(io, req->data, req->len, req->offset, cur);
+	if (!ret && vbuf && !req->discard)
+		ret = verify(io, req, vbuf);
+	return ret ? errno : 0;
+}
+
+
+/* Called with io->lock held */
+static void complete(struct blkio *io, struct blkio_req *req, int err)
+{
+	if (err && !io->error) {
+		pr_error("write of %zu bytes at %llu failed: %s\n", req->len,
+				(unsigned long long)req->offset, strerror(err));
+		io->error = err;
+	}
+	if (!err)
+		io->bytes_written += req->len;
+	if (req->owned)
+		io->free_bufs[io->nfree++] = (void *)req->data;
+	if (req->wb)
+		io->wb[req->wb_slot].done = true;
+	io->pending--;
+	pthread_cond_broadcast(&io->cond);
+}
+
+
+static void *blkio_worker(void *arg)
+{
+	struct blkio *io = arg;
+	struct blkio_req req;
+	void *cur = NULL;
+	void *vbuf = NULL;
+	int err;
+
+	if ((io->flags & BLKIO_DELTA) &&
+			posix_memalign(&cur, BLKIO_ALIGN, BLKIO_BUF_SIZE))
+		die();
+	if ((io->flags & BLKIO_VERIFY) &&
+			posix_memalign(&vbuf, BLKIO_ALIGN, BLKIO_BUF_SIZE))
+		die();
+
+	pthread_mutex_lock(&io->lock);
+	while (1) {
+		while (!io->qcount && !io->stop)
+			pthread_cond_wait(&io->cond, &io->lock);
+		if (!io->qcount)
+			break;
+		req = io->reqs[io->qhead];
+		io->qhead = (io->qhead + 1) % io->depth;
+		io->qcount--;
+		pthread_cond_broadcast(&io->cond);
+		pthread_mutex_unlock(&io->lock);
+
+		err = 0;
+		/* Don't bother once something failed, it's all going to
+		 * be thrown away */
+		if (!__atomic_load_n(&io->error, __ATOMIC_RELAXED))
+			err = process(io, &req, cur, vbuf);
+
+		pthread_mutex_lock(&io->lock);
+		complete(io, &req, err);
+	}
+	pthread_mutex_unlock(&io->lock);
+	free(cur);
+	free(vbuf);
+	return NULL;
+}
+
+
+/* Reap at least min_nr AIO completions */
+static void aio_reap(struct blkio *io, long min_nr)
+{
+	struct io_event events[BLKIO_MAX_DEPTH];
+	int i, n;
+
+	n = io_getevents(io->ctx, min_nr, io->depth, events, NULL);
+	if (n < 0) {
+		if (errno != EINTR) {
+			/* Nothing sensible left to do with the requests */
+			pr_perror("io_getevents");
+			die();
+		}
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		unsigned slot = events[i].data;
+		struct blkio_req *req = &io->reqs[slot];
+		long res = events[i].res;
+		int err = 0;
+
+		if (res < 0)
+			err = -res;
+		else if ((size_t)res < req->len &&
+				pwrite_all(io->fd, (const char *)req->data + res,
+					req->len - res, req->offset + res))
+			/* Finish short writes synchronously */
+			err = errno;
+		io->busy[slot] = false;
+		complete(io, req, err);
+	}
+}
+
+
+int blkio_open_flags(enum blkio_mode mode, unsigned flags)
+{
+	return ((flags & BLKIO_DELTA) ? O_RDWR : O_WRONLY) |
+		(mode == BLKIO_DIRECT ? O_DIRECT : 0);
+}
+
+
+int blkio_parse_mode(const char *str, enum blkio_mode *mode)
+{
+	if (!strcmp(str, "buffered"))
+		*mode = BLKIO_BUFFERED;
+	else if (!strcmp(str, "writeback"))
+		*mode = BLKIO_WRITEBACK;
+	else if (!strcmp(str, "direct"))
+		*mode = BLKIO_DIRECT;
+	else
+		return -1;
+	return 0;
+}
+
+
+/* Reads for verification get their own descriptor, so that they can
+ * bypass the page cache whatever the write mode. Without it nothing could
+ * be verified, so all writes fail. */
+static void open_verify(struct blkio *io)
+{
+	char path[32];
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", io->fd);
+	io->vfd = open(path, O_RDONLY | O_DIRECT);
+	if (io->vfd < 0) {
+		/* tmpfs and the like, there is no device to bypass to */
+		pr_verbose("O_DIRECT verify: %s\n", strerror(errno));
+		io->vfd = open(path, O_RDONLY);
+	}
+	if (io->vfd < 0) {
+		pr_perror("can't open for verification");
+		io->error = errno;
+		return;
+	}
+	if (posix_memalign((void **)&io->vbuf, BLKIO_ALIGN, BLKIO_BUF_SIZE))
+		die();
+}
+
+
+struct blkio *blkio_open(int fd, unsigned depth)
+{
+	return blkio_open_mode(fd, depth, (fcntl(fd, F_GETFL) & O_DIRECT) ?
+			BLKIO_DIRECT : BLKIO_BUFFERED, 0);
+}
+
+
+struct blkio *blkio_open_mode(int fd, unsigned depth, enum blkio_mode mode,
+		unsigned flags)
+{
+	struct blkio *io;
+	unsigned i;
+
+	io = xmalloc(sizeof(*io));
+	memset(io, 0, sizeof(*io));
+	io->fd = fd;
+	io->mode = mode;
+	io->flags = flags;
+	io->zero_method = zero_method(fd);
+	io->vfd = -1;
+	io->depth = depth ? min(depth, (unsigned)BLKIO_MAX_DEPTH) : default_depth;
+	/* Enough buffers to fill one while depth of them are in flight */
+	io->max_bufs = io->depth + 1;
+	io->free_bufs = xmalloc(io->max_bufs * sizeof(void *));
+	io->reqs = xmalloc(io->depth * sizeof(struct blkio_req));
+	io->busy = xmalloc(io->depth * sizeof(bool));
+	memset(io->busy, 0, io->depth * sizeof(bool));
+	pthread_mutex_init(&io->lock, NULL);
+	pthread_cond_init(&io->cond, NULL);
+
+	if (flags & BLKIO_VERIFY)
+		open_verify(io);
+
+	/* Native AIO only really is asynchronous for O_DIRECT. Delta
+	 * writes, zero detection and verification need to look at the
+	 * data, so they are left to the threads. */
+	if (mode == BLKIO_DIRECT && !(flags & (BLKIO_DELTA |
+					BLKIO_ZERO_DETECT | BLKIO_VERIFY)) &&
+			!io_setup(io->depth, &io->ctx)) {
+		io->use_aio = true;
+		pr_verbose("blkio: AIO, depth %u\n", io->depth);
+		return io;
+	}
+
+	io->threads = xmalloc(io->depth * sizeof(pthread_t));
+	for (i = 0; i < io->depth; i++) {
+		if (pthread_create(&io->threads[i], NULL, blkio_worker, io)) {
+			pr_perror("pthread_create");
+			break;
+		}
+		io->nthreads++;
+	}
+	if (!io->nthreads)
+		die();
+	pr_verbose("blkio: %u threads\n", io->nthreads);
+	return io;
+}
+
+
+void *blkio_get_buffer(struct blkio *io)
+{
+	void *buf;
+
+	pthread_mutex_lock(&io->lock);
+	while (!io->nfree && io->nbufs == io->max_bufs) {
+		if (io->use_aio)
+			aio_reap(io, 1);
+		else
+			pthread_cond_wait(&io->cond, &io->lock);
+	}
+	if (io->nfree) {
+		buf = io->free_bufs[--io->nfree];
+		pthread_mutex_unlock(&io->lock);
+		return buf;
+	}
+	io->nbufs++;
+	pthread_mutex_unlock(&io->lock);
+
+	if (posix_memalign(&buf, BLKIO_ALIGN, BLKIO_BUF_SIZE))
+		die();
+	return buf;
+}
+
+
+static int submit_aio(struct blkio *io, struct blkio_req *req)
+{
+	struct iocb *cb;
+	unsigned slot;
+
+	while (io->pending == io->depth)
+		aio_reap(io, 1);
+	for (slot = 0; io->busy[slot]; slot++)
+		;
+
+	io->reqs[slot] = *req;
+	cb = &io->reqs[slot].cb;
+	memset(cb, 0, sizeof(*cb));
+	cb->aio_fildes = io->fd;
+	cb->aio_lio_opcode = IOCB_CMD_PWRITE;
+	cb->aio_buf = (uintptr_t)req->data;
+	cb->aio_nbytes = req->len;
+	cb->aio_offset = req->offset;
+	cb->aio_data = slot;
+
+	while (io_submit(io->ctx, 1, &cb) != 1) {
+		if (errno == EAGAIN && io->pending) {
+			aio_reap(io, 1);
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		return -1;
+	}
+	io->busy[slot] = true;
+	io->pending++;
+	return 0;
+}
+
+
+/* Called with io->lock held */
+static void drain_locked(struct blkio *io)
+{
+	while (io->pending) {
+		if (io->use_aio)
+			aio_reap(io, 1);
+		else
+			pthread_cond_wait(&io->cond, &io->lock);
+	}
+}
+
+
+/* O_DIRECT needs the memory, length and offset aligned to the logical
+ * block size. Anything else, typically the tail of an image, is written
+ * through the page cache instead. Called with io->lock held. */
+static int write_unaligned(struct blkio *io, struct blkio_req *req)
+{
+	int flags = fcntl(io->fd, F_GETFL);
+	int ret = 0;
+
+	drain_locked(io);
+	if (io->error)
+		return -1;
+
+	if (fcntl(io->fd, F_SETFL, flags & ~O_DIRECT) ||
+			pwrite_all(io->fd, req->data, req->len, req->offset) ||
+			fdatasync(io->fd)) {
+		pr_perror("unaligned write");
+		io->error = errno;
+		ret = -1;
+	} else if (io->vbuf && verify(io, req, io->vbuf)) {
+		io->error = errno;
+		ret = -1;
+	} else
+		io->bytes_written += req->len;
+	fcntl(io->fd, F_SETFL, flags);
+
+	if (req->owned)
+		io->free_bufs[io->nfree++] = (void *)req->data;
+	return ret;
+}
+
+
+static inline bool is_aligned(struct blkio_req *req)
+{
+	return !(((uintptr_t)req->data | req->len | req->offset) %
+			BLKIO_ALIGN);
+}
+
+
+/* Writeback mode: add a write about to be queued to the FIFO. Returns
+ * its slot, for complete() to mark it written. */
+static unsigned wb_add(struct blkio *io, uint64_t offset, size_t len)
+{
+	unsigned slot = (io->wb_head + io->wb_count) % BLKIO_WB_RANGES;
+	struct wb_range *r = &io->wb[slot];
+
+	r->offset = offset;
+	r->len = len;
+	r->done = false;
+	io->wb_count++;
+	io->wb_bytes += len;
+	return slot;
+}
+
+
+/* Writeback mode bookkeeping after queueing a write. Flushing is started
+ * for writes as soon as they are done, in order. Once too much is
+ * outstanding, the oldest half of the window is waited for; only the
+ * writes of those ranges have to be complete for that, the rest of the
+ * queue keeps going. Called with io->lock held, by the producer only;
+ * the lock is dropped around the syscalls. */
+static void writeback(struct blkio *io)
+{
+	struct wb_range *r;
+	bool full;
+
+	while (io->wb_kicked < io->wb_count) {
+		r = &io->wb[(io->wb_head + io->wb_kicked) % BLKIO_WB_RANGES];
+		if (!r->done)
+			break;
+		pthread_mutex_unlock(&io->lock);
+		sync_file_range(io->fd, r->offset, r->len,
+				SYNC_FILE_RANGE_WRITE);
+		pthread_mutex_lock(&io->lock);
+		io->wb_kicked++;
+	}
+
+	full = io->wb_bytes > BLKIO_WB_WINDOW ||
+		io->wb_count == BLKIO_WB_RANGES;
+	while (full && (io->wb_bytes > BLKIO_WB_WINDOW / 2 ||
+				io->wb_count > BLKIO_WB_RANGES / 2)) {
+		r = &io->wb[io->wb_head];
+		while (!r->done)
+			pthread_cond_wait(&io->cond, &io->lock);
+		pthread_mutex_unlock(&io->lock);
+		if (sync_file_range(io->fd, r->offset, r->len,
+					SYNC_FILE_RANGE_WAIT_BEFORE |
+					SYNC_FILE_RANGE_WRITE |
+					SYNC_FILE_RANGE_WAIT_AFTER))
+			pr_perror("sync_file_range");
+		pthread_mutex_lock(&io->lock);
+		__atomic_add_fetch(&io->bytes_synced, r->len, __ATOMIC_RELAXED);
+		io->wb_head = (io->wb_head + 1) % BLKIO_WB_RANGES;
+		io->wb_count--;
+		io->wb_bytes -= r->len;
+		if (io->wb_kicked)
+			io->wb_kicked--;
+	}
+}
+
+
+uint64_t blkio_bytes_done(struct blkio *io)
+{
+	uint64_t ret;
+
+	if (io->mode == BLKIO_WRITEBACK)
+		return __atomic_load_n(&io->bytes_synced, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&io->lock);
+	ret = io->bytes_written;
+	pthread_mutex_unlock(&io->lock);
+	return ret;
+}
+
+
+static int queue(struct blkio *io, struct blkio_req *req)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&io->lock);
+	if (io->error)
+		goto fail;
+
+	if (io->mode == BLKIO_DIRECT && !is_aligned(req)) {
+		ret = write_unaligned(io, req);
+		pthread_mutex_unlock(&io->lock);
+		return ret;
+	}
+
+	if (io->use_aio && !req->data) {
+		/* Zeroing and discarding are synchronous anyway */
+		pthread_mutex_unlock(&io->lock);
+		ret = zero_or_discard(io, req);
+		pthread_mutex_lock(&io->lock);
+		if (ret) {
+			pr_perror("zeroing");
+			io->error = errno;
+			goto fail;
+		}
+		io->bytes_written += req->len;
+	} else if (io->use_aio) {
+		if (submit_aio(io, req)) {
+			pr_perror("io_submit");
+			io->error = errno;
+			goto fail;
+		}
+	} else {
+		while (io->qcount == io->depth)
+			pthread_cond_wait(&io->cond, &io->lock);
+		/* Writeback mode never uses AIO */
+		if (io->mode == BLKIO_WRITEBACK && !req->discard) {
+			req->wb = true;
+			req->wb_slot = wb_add(io, req->offset, req->len);
+		}
+		io->reqs[(io->qhead + io->qcount) % io->depth] = *req;
+		io->qcount++;
+		io->pending++;
+		pthread_cond_broadcast(&io->cond);
+	}
+	if (req->wb)
+		writeback(io);
+	pthread_mutex_unlock(&io->lock);
+	return 0;
+
+fail:
+	if (req->owned)
+		io->free_bufs[io->nfree++] = (void *)req->data;
+	ret = -1;
+	pthread_mutex_unlock(&io->lock);
+	return ret;
+}
+
+
+int blkio_write(struct blkio *io, void *buf, size_t len, uint64_t offset)
+{
+	struct blkio_req req = {
+		.data = buf, .len = len, .offset = offset, .owned = true
+	};
+
+	return queue(io, &req);
+}
+
+
+int blkio_write_external(struct blkio *io, const void *data, size_t len,
+		uint64_t offset)
+{
+	struct blkio_req req = { .data = data, .len = len, .offset = offset };
+
+	return queue(io, &req);
+}
+
+
+int blkio_zero(struct blkio *io, uint64_t offset, uint64_t len)
+{
+	struct blkio_req req = { .len = len, .offset = offset };
+
+	return queue(io, &req);
+}
+
+
+int blkio_discard(struct blkio *io, uint64_t offset, uint64_t len)
+{
+	struct blkio_req req = { .discard = true };
+	uint64_t start = (offset + BLKIO_ALIGN - 1) & ~(uint64_t)(BLKIO_ALIGN - 1);
+	uint64_t end = (offset + len) & ~(uint64_t)(BLKIO_ALIGN - 1);
+
+	if (!(io->flags & BLKIO_DISCARD) || end <= start)
+		return 0;
+	req.offset = start;
+	req.len = end - start;
+	return queue(io, &req);
+}
+
+
+int blkio_drain(struct blkio *io)
+{
+	int ret;
+
+	pthread_mutex_lock(&io->lock);
+	drain_locked(io);
+	ret = io->error ? -1 : 0;
+	pthread_mutex_unlock(&io->lock);
+	return ret;
+}
+
+
+int blkio_close(struct blkio *io, bool sync)
+{
+	unsigned i;
+	int ret;
+
+	ret = blkio_drain(io);
+	if (!ret && sync && fdatasync(io->fd)) {
+		pr_perror("fdatasync");
+		ret = -1;
+	}
+	if (!ret && sync)
+		io->bytes_synced = io->bytes_written;
+	if (io->bytes_unchanged || io->bytes_zeroed || io->bytes_discarded ||
+			io->bytes_verified)
+		pr_debug("%llu bytes: %llu unchanged, %llu zeroed, %llu discarded, %llu verified\n",
+				(unsigned long long)io->bytes_written,
+				(unsigned long long)io->bytes_unchanged,
+				(unsigned long long)io->bytes_zeroed,
+				(unsigned long long)io->bytes_discarded,
+				(unsigned long long)io->bytes_verified);
+	if (io->vfd >= 0)
+		close(io->vfd);
+	free(io->vbuf);
+
+	if (io->use_aio)
+		io_destroy(io->ctx);
+	pthread_mutex_lock(&io->lock);
+	io->stop = true;
+	pthread_cond_broadcast(&io->cond);
+	pthread_mutex_unlock(&io->lock);
+	for (i = 0; i < io->nthreads; i++)
+		pthread_join(io->threads[i], NULL);
+
+	for (i = 0; i < io->nfree; i++)
+		free(io->free_bufs[i]);
+	pthread_mutex_destroy(&io->lock);
+	pthread_cond_destroy(&io->cond);
+	free(io->threads);
+	free(io->free_bufs);
+	free(io->reqs);
+	free(io->busy);
+	free(io);
+	return ret;
+}
+
+
+/* Returns -1 if BLKZEROOUT fails, with offset and len advanced past what
+ * it did zero */
+static int zeroout(int fd, uint64_t *offset, uint64_t *len, uint64_t chunk)
+{
+	uint64_t range[2];
+
+	while (*len) {
+		range[0] = *offset;
+		range[1] = min(*len, chunk);
+		if (ioctl(fd, BLKZEROOUT, &range))
+			return -1;
+		*offset += range[1];
+		*len -= range[1];
+	}
+	return 0;
+}
+
+
+int blkio_zero_fill(int fd, uint64_t offset, uint64_t len)
+{
+	char path[32];
+	struct blkio *io;
+	int64_t chunk;
+	int dfd;
+	int ret;
+
+	/* 0 means the device has no write zeroes command, and the kernel
+	 * would just write zero pages, one chunk at a time */
+	chunk = read_queue_attr(fd, "write_zeroes_max_bytes");
+	if (chunk < 0)
+		chunk = BLKIO_ZEROOUT_CHUNK;
+	if (chunk) {
+		if (!zeroout(fd, &offset, &len, chunk))
+			return 0;
+		pr_verbose("BLKZEROOUT: %s, writing zeroes\n",
+				strerror(errno));
+	}
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	dfd = open(path, O_WRONLY | O_DIRECT);
+	if (dfd >= 0) {
+		io = blkio_open_mode(dfd, 0, BLKIO_DIRECT, 0);
+	} else {
+		pr_verbose("O_DIRECT zeroing: %s\n", strerror(errno));
+		io = blkio_open_mode(fd, 0, BLKIO_WRITEBACK, 0);
+	}
+	while (len) {
+		size_t n = min(len, (uint64_t)BLKIO_BUF_SIZE);
+
+		if (blkio_write_external(io, zero_buf, n, offset))
+			break;
+		offset += n;
+		len -= n;
+	}
+	ret = blkio_close(io, true);
+	if (dfd >= 0)
+		close(dfd);
+	return ret;
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USERFASTBOOT_BLKIO_H_
+#define _USERFASTBOOT_BLKIO_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size of the buffers handed out by blkio_get_buffer() */
+#define BLKIO_BUF_SIZE		(1024 * 1024)
+
+/* Alignment of those buffers, and granularity of blkio_zero() */
+#define BLKIO_ALIGN		4096
+
+/* How data gets to the device. Buffered is plain page cache writes,
+ * flushed at the end. Writeback starts flushing each write as soon as it
+ * is done, and waits for the flushes once a few MiB are pending, so only
+ * a bounded amount of dirty data ever builds up. Direct bypasses the
+ * page cache altogether; the descriptor must have been opened with
+ * blkio_open_flags(BLKIO_DIRECT, ...). */
+enum blkio_mode {
+	BLKIO_BUFFERED,
+	BLKIO_WRITEBACK,
+	BLKIO_DIRECT,
+};
+
+/* Flags for blkio_open_mode() */
+
+/* Read back what is already on the device and only write the blocks that
+ * differ. Worth it when reflashing mostly identical images, since reads
+ * are a lot faster than writes on eMMC and don't wear it out. The fd
+ * must be readable. */
+#define BLKIO_DELTA		(1 << 0)
+
+/* Look for runs of zero blocks in the data written and have the device
+ * zero them instead, see blkio_zero(). Raw images tend to have plenty. */
+#define BLKIO_ZERO_DETECT	(1 << 1)
+
+/* Have blkio_discard() actually discard */
+#define BLKIO_DISCARD		(1 << 2)
+
+/* Read back every write and zeroed range as soon as it completed, with
+ * O_DIRECT so that it comes from the device rather than the page cache,
+ * and fail on any difference. Done by the worker threads, so it overlaps
+ * with the writes still in flight. */
+#define BLKIO_VERIFY		(1 << 3)
+
+/* Asynchronous block writer, keeping up to a queue depth worth of writes
+ * outstanding on one file descriptor. BLKIO_DIRECT without BLKIO_DELTA,
+ * BLKIO_ZERO_DETECT or BLKIO_VERIFY is driven with native AIO, since
+ * those need to look at the data; anything else goes through a pool of
+ * threads.
+ * Writes may complete in any order, so callers must not queue writes
+ * that overlap without draining in between.
+ *
+ * Only to be used from one thread at a time. */
+struct blkio;
+
+/* depth of 0 means the default, see blkio_set_default_depth(). The fd
+ * remains owned by the caller. Uses BLKIO_DIRECT if the fd has O_DIRECT
+ * set, BLKIO_BUFFERED otherwise. */
+struct blkio *blkio_open(int fd, unsigned depth);
+struct blkio *blkio_open_mode(int fd, unsigned depth, enum blkio_mode mode,
+		unsigned flags);
+
+/* open() flags, access mode included, for a descriptor to be used with
+ * the given mode and flags */
+int blkio_open_flags(enum blkio_mode mode, unsigned flags);
+
+/* Parse "buffered", "writeback" or "direct". Returns 0 on success. */
+int blkio_parse_mode(const char *str, enum blkio_mode *mode);
+
+/* Returns a BLKIO_BUF_SIZE buffer, aligned for O_DIRECT, to be filled and
+ * passed to blkio_write(). Waits for a write to complete if all of them
+ * are in use. */
+void *blkio_get_buffer(struct blkio *io);
+
+/* Queue writing len bytes of a buffer from blkio_get_buffer() to offset.
+ * The buffer goes back to the pool once written. Returns -1 if this or
+ * any earlier write failed; the buffer is reclaimed either way. */
+int blkio_write(struct blkio *io, void *buf, size_t len, uint64_t offset);
+
+/* Like blkio_write(), for data the caller owns, which must stay unchanged
+ * until blkio_drain() or blkio_close(). The same data may be queued for
+ * several offsets. */
+int blkio_write_external(struct blkio *io, const void *data, size_t len,
+		uint64_t offset);
+
+/* Bytes known to be on the device: written for BLKIO_DIRECT, flushed
+ * for BLKIO_WRITEBACK, merely written to the page cache for
+ * BLKIO_BUFFERED. Meant for progress reporting. */
+uint64_t blkio_bytes_done(struct blkio *io);
+
+/* Queue zeroing of a range. Uses BLKDISCARD if the device guarantees
+ * discarded blocks read back as zeroes, BLKZEROOUT otherwise, or punches
+ * a hole for regular files, and only writes zeroes if none of that
+ * works. offset and len must be multiples of BLKIO_ALIGN. */
+int blkio_zero(struct blkio *io, uint64_t offset, uint64_t len);
+
+/* Range whose contents don't matter, such as the gaps in a sparse image.
+ * With BLKIO_DISCARD, the whole blocks in it are discarded, so the flash
+ * translation layer can stop keeping stale data around. Does nothing
+ * otherwise. Discard failures are ignored. */
+int blkio_discard(struct blkio *io, uint64_t offset, uint64_t len);
+
+/* Wait for all queued writes. Returns -1 if any of them failed. */
+int blkio_drain(struct blkio *io);
+
+/* Drain, fdatasync() the descriptor if sync is set, and free io. Returns
+ * -1 if any write or the sync failed. */
+int blkio_close(struct blkio *io, bool sync);
+
+/* Zero len bytes of fd at offset, as fast as the device allows, and wait
+ * for it. Uses BLKZEROOUT if the device can zero by itself, otherwise
+ * writes zeroes with O_DIRECT, a queue depth of them in flight. Returns
+ * 0 on success. */
+int blkio_zero_fill(int fd, uint64_t offset, uint64_t len);
+
+void blkio_set_default_depth(unsigned depth);
+unsigned blkio_get_default_depth(void);
+
+#endif
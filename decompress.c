@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "decompress.h"
+#include "userfastboot_ui.h"
+#include "userfastboot_util.h"
+
+#define OUT_BUF_SIZE	(1024 * 1024)
+
+struct decompressor {
+	z_stream zs;
+	bool multi_member;	/* gzip allows several concatenated members */
+	bool ended;
+	bool failed;
+	unsigned char *out;
+	int (*consume)(const void *buf, size_t len, void *context);
+	void *context;
+};
+
+
+struct decompressor *decompressor_open(const char *format,
+		int (*consume)(const void *buf, size_t len, void *context),
+		void *context)
+{
+	struct decompressor *d;
+	int window_bits;
+
+	if (!strcmp(format, "gzip") || !strcmp(format, "zlib"))
+		/* zlib detects which of the two headers is present */
+		window_bits = MAX_WBITS + 32;
+	else if (!strcmp(format, "deflate"))
+		window_bits = -MAX_WBITS;
+	else {
+		pr_error("unsupported compression '%s'\n", format);
+		return NULL;
+	}
+
+	d = xmalloc(sizeof(*d));
+	memset(d, 0, sizeof(*d));
+	if (inflateInit2(&d->zs, window_bits) != Z_OK) {
+		pr_error("inflateInit2 failed\n");
+		free(d);
+		return NULL;
+	}
+	d->multi_member = window_bits > 0;
+	d->out = xmalloc(OUT_BUF_SIZE);
+	d->consume = consume;
+	d->context = context;
+	return d;
+}
+
+
+static int process(struct decompressor *d)
+{
+	size_t n;
+	int ret;
+
+	do {
+		if (d->ended) {
+			if (!d->zs.avail_in)
+				break;
+			if (!d->multi_member) {
+				pr_error("trailing data after compressed stream\n");
+				return -1;
+			}
+			inflateReset(&d->zs);
+			d->ended = false;
+		}
+
+		d->zs.next_out = d->out;
+		d->zs.avail_out = OUT_BUF_SIZE;
+		ret = inflate(&d->zs, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+			pr_error("decompression failed: %s\n",
+					d->zs.msg ? d->zs.msg : "unknown error");
+			return -1;
+		}
+
+		n = OUT_BUF_SIZE - d->zs.avail_out;
+		if (n && d->consume(d->out, n, d->context))
+			return -1;
+
+		if (ret == Z_STREAM_END)
+			d->ended = true;
+		else if (ret == Z_BUF_ERROR)
+			break;
+		/* A full output buffer may mean there is more to come even
+		 * with all of the input consumed */
+	} while (d->zs.avail_in || !d->zs.avail_out);
+
+	return 0;
+}
+
+
+int decompressor_write(struct decompressor *d, const void *data, size_t len)
+{
+	if (d->failed)
+		return -1;
+
+	d->zs.next_in = (Bytef *)data;
+	d->zs.avail_in = len;
+	if (process(d)) {
+		d->failed = true;
+		return -1;
+	}
+	return 0;
+}
+
+
+int decompressor_close(struct decompressor *d)
+{
+	int ret = 0;
+
+	if (d->failed)
+		ret = -1;
+	else if (!d->ended) {
+		pr_error("compressed stream truncated\n");
+		ret = -1;
+	}
+
+	inflateEnd(&d->zs);
+	free(d->out);
+	free(d);
+	return ret;
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
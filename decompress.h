@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USERFASTBOOT_DECOMPRESS_H_
+#define _USERFASTBOOT_DECOMPRESS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Comma separated list of the formats decompressor_open() takes */
+#define DECOMPRESSOR_FORMATS	"gzip,zlib,deflate"
+
+/* Decompresses a stream fed in arbitrarily sized pieces, passing the
+ * output on to consume() as it is produced. */
+struct decompressor;
+
+/* Returns NULL if format isn't one of DECOMPRESSOR_FORMATS */
+struct decompressor *decompressor_open(const char *format,
+		int (*consume)(const void *buf, size_t len, void *context),
+		void *context);
+
+/* Returns 0 on success, -1 if the stream is corrupt or consume() failed.
+ * Once this fails, all further calls fail too. */
+int decompressor_write(struct decompressor *d, const void *data, size_t len);
+
+/* Check that the compressed stream was complete, and free the
+ * decompressor. Returns 0 on success. */
+int decompressor_close(struct decompressor *d);
+
+#endif
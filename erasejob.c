@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "erasejob.h"
+#include "fastboot.h"
+#include "stats.h"
+#include "userfastboot_ui.h"
+#include "userfastboot_util.h"
+
+/* How often erase_job_wait() updates the progress bar, and tells the
+ * host how long it will take */
+#define PROGRESS_INTERVAL_US	(100 * 1000)
+#define NS_PER_SEC		(1000ULL * 1000 * 1000)
+#define ETA_INTERVAL_NS		(5 * NS_PER_SEC)
+
+struct erase_job {
+	struct fstab_rec *vol;
+	char *name;
+	pthread_t thread;
+	uint64_t size;
+	uint64_t erased;	/* updated by the job as it goes */
+	bool done;
+	int ret;
+	struct erase_job *next;
+};
+
+/* Only the command handlers touch the list. A job thread only updates
+ * its own erased, done and ret. */
+static struct erase_job *jobs;
+
+static void publish_status(const char *name, const char *status)
+{
+	char var[64];
+
+	snprintf(var, sizeof(var), "erase-status:%s", name);
+	fastboot_publish(var, xstrdup(status));
+}
+
+static void *erase_thread(void *arg)
+{
+	struct erase_job *job = arg;
+
+	job->ret = erase_partition(job->vol, &job->erased);
+	if (job->ret)
+		pr_error("erase of %s failed\n", job->name);
+	else
+		pr_info("erase of %s done\n", job->name);
+	publish_status(job->name, job->ret ? "failed" : "done");
+	__atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+int erase_job_start(struct fstab_rec *vol, const char *name)
+{
+	struct erase_job *job;
+
+	/* Whatever became of it, it is about to be erased again */
+	erase_job_wait(vol->blk_device);
+
+	job = xmalloc(sizeof(*job));
+	memset(job, 0, sizeof(*job));
+	job->vol = vol;
+	job->name = xstrdup(name);
+	/* Only used for progress */
+	if (get_volume_size(vol, &job->size))
+		job->size = 0;
+	publish_status(name, "running");
+	if (pthread_create(&job->thread, NULL, erase_thread, job)) {
+		pr_perror("pthread_create");
+		publish_status(name, "failed");
+		free(job->name);
+		free(job);
+		return -1;
+	}
+	job->next = jobs;
+	jobs = job;
+	return 0;
+}
+
+/* All jobs match if devices is NULL */
+static bool job_matches(struct erase_job *job, const char **devices,
+		int count)
+{
+	int i;
+
+	if (!devices)
+		return true;
+	for (i = 0; i < count; i++)
+		if (!strcmp(job->vol->blk_device, devices[i]))
+			return true;
+	return false;
+}
+
+/* Show the combined progress of the matching jobs until they are done.
+ * The time left is estimated from the rate since we started waiting. */
+static void show_progress(const char **devices, int count)
+{
+	struct erase_job *job;
+	uint64_t size, erased;
+	uint64_t now, since = 0, erased_since = 0, last_info = 0;
+	unsigned long long eta;
+	bool busy, shown = false;
+
+	while (1) {
+		size = erased = 0;
+		busy = false;
+		for (job = jobs; job; job = job->next) {
+			if (!job_matches(job, devices, count))
+				continue;
+			size += job->size;
+			erased += __atomic_load_n(&job->erased,
+					__ATOMIC_RELAXED);
+			if (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE))
+				busy = true;
+		}
+		if (!busy)
+			break;
+		if (!shown) {
+			mui_show_progress(1.0, 0);
+			shown = true;
+		}
+		if (size)
+			mui_set_progress((float)erased / (float)size);
+
+		now = stats_now();
+		if (!since) {
+			since = last_info = now;
+			erased_since = erased;
+		} else if (size > erased && erased > erased_since &&
+				now - last_info >= ETA_INTERVAL_NS) {
+			eta = (double)(size - erased) * (now - since) /
+				(erased - erased_since) / NS_PER_SEC;
+			fastboot_info("erasing: %u%%, about %llus left",
+					(unsigned)(erased * 100 / size), eta);
+			last_info = now;
+		}
+		usleep(PROGRESS_INTERVAL_US);
+	}
+	if (shown)
+		mui_reset_progress();
+}
+
+static int wait_jobs(const char **devices, int count, char **failed)
+{
+	struct erase_job **pos = &jobs;
+	struct erase_job *job;
+	char *names;
+	int ret = 0;
+
+	show_progress(devices, count);
+	while ((job = *pos)) {
+		if (!job_matches(job, devices, count)) {
+			pos = &job->next;
+			continue;
+		}
+		pthread_join(job->thread, NULL);
+		if (job->ret) {
+			ret = -1;
+			if (failed && *failed) {
+				names = xasprintf("%s,%s", *failed, job->name);
+				free(*failed);
+				*failed = names;
+			} else if (failed) {
+				*failed = xstrdup(job->name);
+			}
+		}
+		*pos = job->next;
+		free(job->name);
+		free(job);
+	}
+	return ret;
+}
+
+int erase_job_wait(const char *device)
+{
+	if (!device)
+		return wait_jobs(NULL, 0, NULL);
+	return wait_jobs(&device, 1, NULL);
+}
+
+int erase_job_wait_devices(const char **devices, int count, char **failed)
+{
+	if (failed)
+		*failed = NULL;
+	return wait_jobs(devices, count, failed);
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USERFASTBOOT_ERASEJOB_H_
+#define _USERFASTBOOT_ERASEJOB_H_
+
+#include "userfastboot_fstab.h"
+
+/* Partition erases running in a thread of their own, so that several
+ * partitions can be erased at once, and so that the host can go on with
+ * downloads while a slow discard completes. Anything else
+ * touching a partition being erased must erase_job_wait() for it first.
+ * Only to be called from the command handlers, under action_mutex.
+ *
+ * Progress is published as erase-status:<name>, which reads running,
+ * done or failed. */
+
+/* Start erasing vol, name being its partition name. Waits for an erase
+ * already running on the same device first. Returns 0 if the job was
+ * started. */
+int erase_job_start(struct fstab_rec *vol, const char *name);
+
+/* Wait for the jobs erasing device, or for all of them if NULL, showing
+ * their combined progress and sending the host an estimate of the time
+ * left every few seconds. Returns -1 if any of them failed; a failure
+ * is only reported once. */
+int erase_job_wait(const char *device);
+
+/* The same, for the jobs erasing any of the count devices; others keep
+ * running. If failed is non-NULL, it is set to NULL, or to a
+ * comma-separated list of the partitions whose erase failed, which the
+ * caller frees. */
+int erase_job_wait_devices(const char **devices, int count, char **failed);
+
+#endif
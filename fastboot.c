@@ -36,6 +36,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <sched.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <sys/mman.h>
@@ -43,13 +44,17 @@
 #include <linux/usb/ch9.h>
 #include <linux/usb/functionfs.h>
 #include <inttypes.h>
+#include <sys/syscall.h>
 
-#include <cutils/hashmap.h>
+#include <zlib.h>
 
 #include "userfastboot.h"
 #include "userfastboot_ui.h"
 #include "fastboot.h"
 #include "userfastboot_util.h"
+#include "decompress.h"
+#include "stats.h"
+#include "userfastboot_aio.h"
 
 
 #define USB_ADB_PATH      "/dev/android_adb"
@@ -73,78 +78,166 @@
 #define MAX_PACKET_SIZE_FS	64
 #define MAX_PACKET_SIZE_HS	512
 #define MAX_PACKET_SIZE_SS	1024
+
+/* Packets per SuperSpeed burst, minus one. 15 is the most the spec
+ * allows, the UDC driver clamps it to what the controller can do */
+#define MAX_BURST_SS		15
+
+/* f_adb refuses reads larger than its 4 KiB bulk buffer */
+#define ADB_MAX_READ		4096
+
+/* FunctionFS bounces every request through a kmalloc'd kernel buffer, so
+ * keep the requests moderately sized and get the throughput from keeping
+ * several of them queued on the endpoint instead */
+#define FFS_AIO_REQ_SIZE	(1024 * 1024)
+#define FFS_AIO_DEPTH		8
+
+/* Older kernel headers lack these */
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC		0x0001U
+#define MFD_ALLOW_SEALING	0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS		(F_LINUX_SPECIFIC_BASE + 9)
+#define F_SEAL_SEAL		0x0001
+#define F_SEAL_SHRINK		0x0002
+#define F_SEAL_GROW		0x0004
+#define F_SEAL_WRITE		0x0008
+#endif
+
+/* Pipe size asked for when splicing from a TCP socket */
+#define SPLICE_PIPE_SIZE	(1024 * 1024)
+
 struct io_fds
 {
 	int read_fp;
 	int write_fp;
+	unsigned max_read;	/* largest single read() the transport takes */
+	aio_context_t aio_ctx;	/* FunctionFS bulk-out AIO, 0 if unavailable */
+	bool can_splice;	/* read_fp is a socket we can splice() from */
 };
 static struct io_fds io;
 
-static const struct {
+struct func_desc {
+	struct usb_interface_descriptor intf;
+	struct usb_endpoint_descriptor_no_audio source;
+	struct usb_endpoint_descriptor_no_audio sink;
+} __attribute__((packed));
+
+struct ss_func_desc {
+	struct usb_interface_descriptor intf;
+	struct usb_endpoint_descriptor_no_audio source;
+	struct usb_ss_ep_comp_descriptor source_comp;
+	struct usb_endpoint_descriptor_no_audio sink;
+	struct usb_ss_ep_comp_descriptor sink_comp;
+} __attribute__((packed));
+
+/* Legacy descriptor format, full and high speed only */
+struct desc_v1 {
 	struct usb_functionfs_descs_head header;
-	struct {
-		struct usb_interface_descriptor intf;
-		struct usb_endpoint_descriptor_no_audio source;
-		struct usb_endpoint_descriptor_no_audio sink;
-	} __attribute__((packed)) fs_descs, hs_descs;
-} __attribute__((packed)) descriptors = {
-	.header = {
-		.magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC),
-		.length = cpu_to_le32(sizeof(descriptors)),
-		.fs_count = 3,
-		.hs_count = 3,
+	struct func_desc fs_descs, hs_descs;
+} __attribute__((packed));
+
+/* Kernels since 3.15 take this format, which can also carry the
+ * SuperSpeed descriptors */
+struct desc_v2 {
+	struct usb_functionfs_descs_head_v2 header;
+	/* The rest of the structure depends on the flags in the header */
+	__le32 fs_count;
+	__le32 hs_count;
+	__le32 ss_count;
+	struct func_desc fs_descs, hs_descs;
+	struct ss_func_desc ss_descs;
+} __attribute__((packed));
+
+static const struct func_desc fs_descriptors = {
+	.intf = {
+		.bLength = sizeof(fs_descriptors.intf),
+		.bDescriptorType = USB_DT_INTERFACE,
+		.bInterfaceNumber = 0,
+		.bNumEndpoints = 2,
+		.bInterfaceClass = ADB_CLASS,
+		.bInterfaceSubClass = ADB_SUBCLASS,
+		.bInterfaceProtocol = FASTBOOT_PROTOCOL,
+		.iInterface = 1, /* first string from the provided table */
+	},
+	.source = {
+		.bLength = sizeof(fs_descriptors.source),
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = 1 | USB_DIR_OUT,
+		.bmAttributes = USB_ENDPOINT_XFER_BULK,
+		.wMaxPacketSize = MAX_PACKET_SIZE_FS,
+	},
+	.sink = {
+		.bLength = sizeof(fs_descriptors.sink),
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = 2 | USB_DIR_IN,
+		.bmAttributes = USB_ENDPOINT_XFER_BULK,
+		.wMaxPacketSize = MAX_PACKET_SIZE_FS,
+	},
+};
+
+static const struct func_desc hs_descriptors = {
+	.intf = {
+		.bLength = sizeof(hs_descriptors.intf),
+		.bDescriptorType = USB_DT_INTERFACE,
+		.bInterfaceNumber = 0,
+		.bNumEndpoints = 2,
+		.bInterfaceClass = ADB_CLASS,
+		.bInterfaceSubClass = ADB_SUBCLASS,
+		.bInterfaceProtocol = FASTBOOT_PROTOCOL,
+		.iInterface = 1, /* first string from the provided table */
+	},
+	.source = {
+		.bLength = sizeof(hs_descriptors.source),
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = 1 | USB_DIR_OUT,
+		.bmAttributes = USB_ENDPOINT_XFER_BULK,
+		.wMaxPacketSize = MAX_PACKET_SIZE_HS,
+	},
+	.sink = {
+		.bLength = sizeof(hs_descriptors.sink),
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = 2 | USB_DIR_IN,
+		.bmAttributes = USB_ENDPOINT_XFER_BULK,
+		.wMaxPacketSize = MAX_PACKET_SIZE_HS,
 	},
-	.fs_descs = {
-		.intf = {
-			.bLength = sizeof(descriptors.fs_descs.intf),
-			.bDescriptorType = USB_DT_INTERFACE,
-			.bInterfaceNumber = 0,
-			.bNumEndpoints = 2,
-			.bInterfaceClass = ADB_CLASS,
-			.bInterfaceSubClass = ADB_SUBCLASS,
-			.bInterfaceProtocol = FASTBOOT_PROTOCOL,
-			.iInterface = 1, /* first string from the provided table */
-		},
-		.source = {
-			.bLength = sizeof(descriptors.fs_descs.source),
-			.bDescriptorType = USB_DT_ENDPOINT,
-			.bEndpointAddress = 1 | USB_DIR_OUT,
-			.bmAttributes = USB_ENDPOINT_XFER_BULK,
-			.wMaxPacketSize = MAX_PACKET_SIZE_FS,
-		},
-		.sink = {
-			.bLength = sizeof(descriptors.fs_descs.sink),
-			.bDescriptorType = USB_DT_ENDPOINT,
-			.bEndpointAddress = 2 | USB_DIR_IN,
-			.bmAttributes = USB_ENDPOINT_XFER_BULK,
-			.wMaxPacketSize = MAX_PACKET_SIZE_FS,
-		},
+};
+
+static const struct ss_func_desc ss_descriptors = {
+	.intf = {
+		.bLength = sizeof(ss_descriptors.intf),
+		.bDescriptorType = USB_DT_INTERFACE,
+		.bInterfaceNumber = 0,
+		.bNumEndpoints = 2,
+		.bInterfaceClass = ADB_CLASS,
+		.bInterfaceSubClass = ADB_SUBCLASS,
+		.bInterfaceProtocol = FASTBOOT_PROTOCOL,
+		.iInterface = 1, /* first string from the provided table */
+	},
+	.source = {
+		.bLength = sizeof(ss_descriptors.source),
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = 1 | USB_DIR_OUT,
+		.bmAttributes = USB_ENDPOINT_XFER_BULK,
+		.wMaxPacketSize = MAX_PACKET_SIZE_SS,
 	},
-	.hs_descs = {
-		.intf = {
-			.bLength = sizeof(descriptors.hs_descs.intf),
-			.bDescriptorType = USB_DT_INTERFACE,
-			.bInterfaceNumber = 0,
-			.bNumEndpoints = 2,
-			.bInterfaceClass = ADB_CLASS,
-			.bInterfaceSubClass = ADB_SUBCLASS,
-			.bInterfaceProtocol = FASTBOOT_PROTOCOL,
-			.iInterface = 1, /* first string from the provided table */
-		},
-		.source = {
-			.bLength = sizeof(descriptors.hs_descs.source),
-			.bDescriptorType = USB_DT_ENDPOINT,
-			.bEndpointAddress = 1 | USB_DIR_OUT,
-			.bmAttributes = USB_ENDPOINT_XFER_BULK,
-			.wMaxPacketSize = MAX_PACKET_SIZE_HS,
-		},
-		.sink = {
-			.bLength = sizeof(descriptors.hs_descs.sink),
-			.bDescriptorType = USB_DT_ENDPOINT,
-			.bEndpointAddress = 2 | USB_DIR_IN,
-			.bmAttributes = USB_ENDPOINT_XFER_BULK,
-			.wMaxPacketSize = MAX_PACKET_SIZE_HS,
-		},
+	.source_comp = {
+		.bLength = sizeof(ss_descriptors.source_comp),
+		.bDescriptorType = USB_DT_SS_ENDPOINT_COMP,
+		.bMaxBurst = MAX_BURST_SS,
+	},
+	.sink = {
+		.bLength = sizeof(ss_descriptors.sink),
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = 2 | USB_DIR_IN,
+		.bmAttributes = USB_ENDPOINT_XFER_BULK,
+		.wMaxPacketSize = MAX_PACKET_SIZE_SS,
+	},
+	.sink_comp = {
+		.bLength = sizeof(ss_descriptors.sink_comp),
+		.bDescriptorType = USB_DT_SS_ENDPOINT_COMP,
+		.bMaxBurst = MAX_BURST_SS,
 	},
 };
 
@@ -192,39 +285,123 @@ void fastboot_register(const char *prefix,
 	cmdlist = cmd;
 }
 
-static Hashmap *vars;
+/* Variables live in an immutable table sorted by name. Readers never
+ * take a lock: they look the table up through the vars pointer, which
+ * publishers replace wholesale with an updated copy. A superseded table
+ * is freed once no reader is left that could still be looking at it.
+ * Publishing is O(n), which is fine for a few hundred variables that
+ * are read far more often than they change. */
+struct var {
+	char *name;
+	char *value;
+};
+
+struct var_table {
+	unsigned gen;
+	size_t count;
+	struct var vars[];
+};
+
+static struct var_table empty_vars;
+static struct var_table *vars = &empty_vars;
+static unsigned vars_readers;
+static pthread_mutex_t vars_publish_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct var_table *vars_read_begin(void)
+{
+	__atomic_add_fetch(&vars_readers, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&vars, __ATOMIC_SEQ_CST);
+}
+
+static void vars_read_end(void)
+{
+	__atomic_sub_fetch(&vars_readers, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Index of name in t, or where it would have to be inserted */
+static size_t vars_find(struct var_table *t, const char *name, bool *found)
+{
+	size_t lo = 0, hi = t->count;
+
+	*found = false;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(name, t->vars[mid].name);
+
+		if (!cmp) {
+			*found = true;
+			return mid;
+		}
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
 
 void fastboot_publish(char *name, char *value)
 {
+	struct var_table *old, *new;
+	char *old_value = NULL;
+	bool found;
+	size_t i;
+
 	pr_verbose("publishing %s=%s\n", name, value);
 
-	hashmapLock(vars);
+	pthread_mutex_lock(&vars_publish_lock);
+	old = vars;
+	i = vars_find(old, name, &found);
 
-	if (hashmapContainsKey(vars, name)) {
+	new = xmalloc(sizeof(*new) + (old->count + !found) * sizeof(struct var));
+	new->gen = old->gen + 1;
+	new->count = old->count + !found;
+	memcpy(new->vars, old->vars, i * sizeof(struct var));
+	if (found) {
 		pr_verbose("replacing old value\n");
-		free(hashmapPut(vars, name, value));
+		old_value = old->vars[i].value;
+		new->vars[i].name = old->vars[i].name;
+		memcpy(new->vars + i + 1, old->vars + i + 1,
+				(old->count - i - 1) * sizeof(struct var));
 	} else {
 		pr_verbose("new value for table\n");
-		hashmapPut(vars, xstrdup(name), value);
+		new->vars[i].name = xstrdup(name);
+		memcpy(new->vars + i + 1, old->vars + i,
+				(old->count - i) * sizeof(struct var));
 	}
+	new->vars[i].value = value;
+
+	__atomic_store_n(&vars, new, __ATOMIC_SEQ_CST);
 
-	hashmapUnlock(vars);
+	/* Readers are only ever a lookup long, wait them out */
+	while (__atomic_load_n(&vars_readers, __ATOMIC_SEQ_CST))
+		sched_yield();
+	if (old != &empty_vars)
+		free(old);
+	free(old_value);
+	pthread_mutex_unlock(&vars_publish_lock);
 }
 
 char *fastboot_getvar(char *name)
 {
-	char *ret;
-
-	hashmapLock(vars);
-	ret = hashmapGet(vars, name);
-	hashmapUnlock(vars);
+	struct var_table *t;
+	char *ret = NULL;
+	bool found;
+	size_t i;
+
+	/* Copy the value, another thread may replace it as soon as we are
+	 * out of the read section */
+	t = vars_read_begin();
+	i = vars_find(t, name, &found);
+	if (found)
+		ret = xstrdup(t->vars[i].value);
+	vars_read_end();
 
 	return ret;
 }
 
 static unsigned char buffer[4096];
 
-static unsigned download_size = 0;
 static unsigned long download_max = 0;
 static pid_t fastboot_pid;
 
@@ -234,6 +411,17 @@ static pid_t fastboot_pid;
 #define STATE_ERROR	3
 
 static unsigned fastboot_state = STATE_OFFLINE;
+static uint64_t command_start;	/* when the current command came in */
+
+/* Set while fastboot_run_command() executes a command on behalf of
+ * another handler rather than the host */
+static struct {
+	bool active;
+	bool whole_download;	/* the command got the entire staged download */
+	bool answered;		/* the outer command already replied */
+	char *response;
+	size_t len;
+} nested;
 
 static int usb_read(void *_buf, unsigned len)
 {
@@ -242,15 +430,18 @@ static int usb_read(void *_buf, unsigned len)
 	unsigned char *buf = _buf;
 	int count = 0;
 	unsigned const len_orig = len;
+	uint64_t start;
 
 	if (fastboot_state == STATE_ERROR)
 		goto oops;
 
 	pr_verbose("usb_read %d\n", len);
 	while (len > 0) {
-		xfer = (len > 4096) ? 4096 : len;
+		xfer = min(len, io.max_read);
 
+		start = stats_now();
 		r = read(io.read_fp, buf, xfer);
+		stats_add_since(STATS_READ_NS, start);
 		if (r < 0) {
 			pr_warning("read");
 			goto oops;
@@ -259,6 +450,7 @@ static int usb_read(void *_buf, unsigned len)
 			goto oops;
 		}
 
+		stats_add(STATS_RX_BYTES, r);
 		count += r;
 		buf += r;
 		len -= r;
@@ -284,19 +476,23 @@ static int usb_write(void *_buf, unsigned len)
 	int r;
 	size_t count = 0;
 	unsigned char *buf = _buf;
+	uint64_t start;
 
 	pr_verbose("usb_write %d\n", len);
 	if (fastboot_state == STATE_ERROR)
 		goto oops;
 
 	do {
+		start = stats_now();
 		r = write(io.write_fp, buf + count, len - count);
+		stats_add_since(STATS_WRITE_NS, start);
 	if (r < 0) {
 		pr_perror("write");
 		goto oops;
 	}
 		 count += r;
 	} while (count < len);
+	stats_add(STATS_TX_BYTES, count);
 
 	return r;
 
@@ -305,38 +501,476 @@ oops:
 	return -1;
 }
 
-static int usb_read_to_file(int fd, unsigned int len)
+/* Bulk data is received by a helper thread into a ring of large buffers,
+ * while the command thread consumes the filled ones in order. This way
+ * the host never waits on whatever we do with the data (writing it out to
+ * tmpfs or straight to a block device) and vice versa. */
+#define XFER_RING_SIZE		(4 * XFER_MEM_SIZE)
+#define XFER_RING_MAX_SLOTS	(XFER_RING_SIZE / FFS_AIO_REQ_SIZE)
+
+struct xfer_ring {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned char *mem;
+	unsigned slots;
+	unsigned slot_size;
+	unsigned slot_len[XFER_RING_MAX_SLOTS];
+	unsigned head;		/* next slot the reader fills */
+	unsigned tail;		/* next slot the consumer drains */
+	unsigned filled;
+	unsigned remaining;	/* bytes not yet read from the host */
+	bool error;
+};
+
+static struct xfer_ring ring = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static inline unsigned char *ring_slot(unsigned i)
 {
-	char buf[XFER_MEM_SIZE];
-	int r = 0;
-	int count = 0;
-	unsigned int orig_len = len;
+	return ring.mem + (size_t)i * ring.slot_size;
+}
 
-	lseek64(fd, 0, SEEK_SET);
+static void ring_set_error(void)
+{
+	pthread_mutex_lock(&ring.lock);
+	ring.error = true;
+	pthread_cond_signal(&ring.cond);
+	pthread_mutex_unlock(&ring.lock);
+	fastboot_state = STATE_ERROR;
+}
+
+/* Hand a filled slot over to the consumer */
+static void ring_publish(unsigned len)
+{
+	pthread_mutex_lock(&ring.lock);
+	ring.slot_len[ring.head] = len;
+	ring.head = (ring.head + 1) % ring.slots;
+	ring.remaining -= len;
+	ring.filled++;
+	pthread_cond_signal(&ring.cond);
+	pthread_mutex_unlock(&ring.lock);
+}
+
+static void ring_read_sync(void)
+{
+	while (1) {
+		unsigned char *buf;
+		unsigned size;
+		int r;
+
+		pthread_mutex_lock(&ring.lock);
+		if (ring.filled == ring.slots) {
+			uint64_t start = stats_now();
+
+			while (ring.filled == ring.slots)
+				pthread_cond_wait(&ring.cond, &ring.lock);
+			stats_add_since(STATS_RING_FULL_NS, start);
+		}
+		buf = ring_slot(ring.head);
+		size = min(ring.remaining, ring.slot_size);
+		pthread_mutex_unlock(&ring.lock);
+
+		if (!size)
+			break;
 
-	mui_show_progress(1.0, 0);
-	while (len > 0)
-	{
-		unsigned int size = (len > XFER_MEM_SIZE) ? XFER_MEM_SIZE : len;
 		r = usb_read(buf, size);
-		if ((r < 0) || ((unsigned int)r != size)) {
-			pr_error("fastboot: usb_read_to_file error only got %d bytes\n", r);
-			count = -1;
-			goto out;
+		if (r < 0 || (unsigned)r != size) {
+			pr_error("fastboot: bulk read error, got %d of %u bytes\n",
+					r, size);
+			ring_set_error();
+			break;
 		}
-		r = write(fd, buf, size);
-		if ((r < 0) || ((unsigned int)r != size)) {
-			pr_perror("write");
-			count = -1;
-			goto out;
+		ring_publish(size);
+	}
+}
+
+/* Keep up to FFS_AIO_DEPTH reads queued on the bulk-out endpoint, each
+ * landing directly in a ring slot. The UDC completes requests in order,
+ * so slots are published in the order they were submitted. A request may
+ * complete short, in which case the stream simply continues in the next
+ * slot. Returns 1 if the endpoint doesn't support AIO at all and nothing
+ * was read yet, so the caller can fall back to read(). */
+static int ring_read_aio(void)
+{
+	struct iocb iocbs[XFER_RING_MAX_SLOTS];
+	struct io_event events[FFS_AIO_DEPTH];
+	bool done[XFER_RING_MAX_SLOTS];
+	unsigned next = ring.head;	/* slot for the next request */
+	unsigned inflight = 0;
+	unsigned inflight_bytes = 0;
+	unsigned remaining = ring.remaining;
+	bool submitted_any = false;
+	uint64_t start;
+	int i, n;
+
+	while (remaining) {
+		unsigned free_slots;
+
+		pthread_mutex_lock(&ring.lock);
+		if (!inflight && ring.filled == ring.slots) {
+			uint64_t start = stats_now();
+
+			while (ring.filled == ring.slots)
+				pthread_cond_wait(&ring.cond, &ring.lock);
+			stats_add_since(STATS_RING_FULL_NS, start);
+		}
+		free_slots = ring.slots - ring.filled - inflight;
+		pthread_mutex_unlock(&ring.lock);
+
+		while (inflight < FFS_AIO_DEPTH && free_slots &&
+				remaining > inflight_bytes) {
+			struct iocb *cb = &iocbs[next];
+			unsigned size = min(remaining - inflight_bytes,
+					ring.slot_size);
+
+			memset(cb, 0, sizeof(*cb));
+			cb->aio_fildes = io.read_fp;
+			cb->aio_lio_opcode = IOCB_CMD_PREAD;
+			cb->aio_buf = (uintptr_t)ring_slot(next);
+			cb->aio_nbytes = size;
+			cb->aio_data = next;
+			if (io_submit(io.aio_ctx, 1, &cb) != 1) {
+				if (!submitted_any && (errno == EINVAL ||
+						errno == ENOSYS))
+					return 1;
+				pr_perror("io_submit");
+				goto err;
+			}
+			submitted_any = true;
+			done[next] = false;
+			next = (next + 1) % ring.slots;
+			inflight++;
+			inflight_bytes += size;
+			free_slots--;
+		}
+
+		start = stats_now();
+		n = io_getevents(io.aio_ctx, 1, FFS_AIO_DEPTH, events, NULL);
+		stats_add_since(STATS_READ_NS, start);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_perror("io_getevents");
+			goto err;
 		}
-		len -= size;
+		for (i = 0; i < n; i++) {
+			unsigned slot = events[i].data;
+			long res = events[i].res;
+
+			if (res < 0) {
+				pr_error("fastboot: bulk read error: %s\n",
+						strerror(-res));
+				goto err;
+			}
+			inflight_bytes -= iocbs[slot].aio_nbytes;
+			ring.slot_len[slot] = res;
+			done[slot] = true;
+		}
+
+		while (inflight && done[ring.head]) {
+			unsigned len = ring.slot_len[ring.head];
+
+			if (len > remaining) {
+				pr_error("fastboot: host sent more data than announced\n");
+				goto err;
+			}
+			done[ring.head] = false;
+			remaining -= len;
+			inflight--;
+			stats_add(STATS_RX_BYTES, len);
+			ring_publish(len);
+		}
+	}
+
+	/* Short completions leave requests queued past the end of the
+	 * transfer. Nothing else should be coming from the host until we
+	 * reply, take them back. */
+	while (inflight) {
+		struct io_event ev;
+		struct timespec timeout = { 1, 0 };
+
+		for (i = 0; i < (int)inflight; i++)
+			io_cancel(io.aio_ctx,
+				&iocbs[(ring.head + i) % ring.slots], &ev);
+		n = io_getevents(io.aio_ctx, inflight, FFS_AIO_DEPTH,
+				events, &timeout);
+		if (n < (int)inflight) {
+			pr_error("fastboot: couldn't cancel bulk reads\n");
+			goto err;
+		}
+		for (i = 0; i < n; i++) {
+			if ((long)events[i].res > 0) {
+				pr_error("fastboot: host sent more data than announced\n");
+				goto err;
+			}
+		}
+		inflight = 0;
+	}
+	return 0;
+
+err:
+	/* Anything still queued is reaped by io_destroy() when the
+	 * endpoint gets closed */
+	ring_set_error();
+	return 0;
+}
+
+static void *ring_reader_thread(void *unused)
+{
+	if (io.aio_ctx) {
+		if (!ring_read_aio())
+			return NULL;
+		pr_debug("fastboot: AIO not supported on bulk-out endpoint\n");
+		io_destroy(io.aio_ctx);
+		io.aio_ctx = 0;
+	}
+	ring_read_sync();
+	return NULL;
+}
+
+/* Returns -1 if the transfer from the host failed, 1 if it completed but
+ * consume() failed along the way, 0 on success */
+static int usb_read_stream(unsigned len,
+		int (*consume)(const void *buf, size_t len, void *context),
+		void *context)
+{
+	pthread_t reader;
+	unsigned count = 0;
+	bool consume_failed = false;
+
+	if (!ring.mem)
+		ring.mem = xmalloc(XFER_RING_SIZE);
+	ring.slot_size = io.aio_ctx ? FFS_AIO_REQ_SIZE : XFER_MEM_SIZE;
+	ring.slots = XFER_RING_SIZE / ring.slot_size;
+
+	ring.head = ring.tail = ring.filled = 0;
+	ring.remaining = len;
+	ring.error = false;
+
+	if (pthread_create(&reader, NULL, ring_reader_thread, NULL)) {
+		pr_perror("pthread_create");
+		fastboot_state = STATE_ERROR;
+		return -1;
+	}
+
+	mui_show_progress(1.0, 0);
+	while (count < len) {
+		unsigned char *buf;
+		unsigned size;
+
+		pthread_mutex_lock(&ring.lock);
+		if (!ring.filled && !ring.error) {
+			uint64_t start = stats_now();
+
+			while (!ring.filled && !ring.error)
+				pthread_cond_wait(&ring.cond, &ring.lock);
+			stats_add_since(STATS_RING_EMPTY_NS, start);
+		}
+		if (!ring.filled) {
+			pthread_mutex_unlock(&ring.lock);
+			break;
+		}
+		buf = ring_slot(ring.tail);
+		size = ring.slot_len[ring.tail];
+		pthread_mutex_unlock(&ring.lock);
+
+		/* If the consumer gave up, keep draining so that the host
+		 * finishes sending and the protocol stays in sync */
+		if (!consume_failed) {
+			uint64_t start = stats_now();
+
+			if (consume(buf, size, context))
+				consume_failed = true;
+			stats_add_since(STATS_SINK_NS, start);
+		}
+
+		pthread_mutex_lock(&ring.lock);
+		ring.tail = (ring.tail + 1) % ring.slots;
+		ring.filled--;
+		pthread_cond_signal(&ring.cond);
+		pthread_mutex_unlock(&ring.lock);
+
 		count += size;
-		mui_set_progress((float)count / (float)orig_len);
+		mui_set_progress((float)count / (float)len);
+	}
+	pthread_join(reader, NULL);
+	mui_reset_progress();
+
+	if (ring.error) {
+		fastboot_state = STATE_ERROR;
+		return -1;
+	}
+	return consume_failed ? 1 : 0;
+}
+
+static int write_to_fd(const void *buf, size_t len, void *context)
+{
+	int fd = *(int *)context;
+
+	if (robust_write(fd, buf, len) < 0) {
+		pr_perror("write");
+		return -1;
+	}
+	return 0;
+}
+
+/* Copy whatever is sitting in the pipe to fd the slow way */
+static int drain_pipe_to_fd(int pipe_fd, int fd, size_t len)
+{
+	unsigned char buf[4096];
+
+	while (len) {
+		ssize_t r = read(pipe_fd, buf, min(len, sizeof(buf)));
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_perror("read");
+			return -1;
+		}
+		if (!r) {
+			pr_error("fastboot: pipe drained early\n");
+			return -1;
+		}
+		if (robust_write(fd, buf, r) < 0) {
+			pr_perror("write");
+			return -1;
+		}
+		len -= r;
+	}
+	return 0;
+}
+
+/* Move bulk data from the socket to fd through a pipe, so that it never
+ * gets copied through user space. Returns the number of bytes moved,
+ * which is less than len if fd turned out not to support splice() and
+ * the caller has to read the rest itself, or -1 on error. */
+static int usb_splice_to_fd(int fd, unsigned len)
+{
+	int pipefd[2];
+	unsigned count = 0;
+	ssize_t in, out;
+	uint64_t start;
+
+	if (pipe(pipefd)) {
+		pr_perror("pipe");
+		return 0;
+	}
+	/* The default 64 KiB pipe means a lot of round trips, try to get
+	 * a bigger one. Not fatal if the limit doesn't allow it */
+	fcntl(pipefd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+
+	mui_show_progress(1.0, 0);
+	while (count < len) {
+		start = stats_now();
+		in = splice(io.read_fp, NULL, pipefd[1], NULL,
+				min(len - count, (unsigned)SPLICE_PIPE_SIZE),
+				SPLICE_F_MOVE | SPLICE_F_MORE);
+		stats_add_since(STATS_READ_NS, start);
+		if (in < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EINVAL && !count) {
+				pr_debug("fastboot: can't splice from transport\n");
+				break;
+			}
+			pr_perror("splice");
+			goto error;
+		}
+		if (!in) {
+			pr_debug("Connection closed\n");
+			goto error;
+		}
+		stats_add(STATS_RX_BYTES, in);
+
+		while (in) {
+			start = stats_now();
+			out = splice(pipefd[0], NULL, fd, NULL, in,
+					SPLICE_F_MOVE | SPLICE_F_MORE);
+			stats_add_since(STATS_SINK_NS, start);
+			if (out < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno != EINVAL) {
+					pr_perror("splice");
+					goto error;
+				}
+				pr_debug("fastboot: can't splice to target, using buffered reads\n");
+				if (drain_pipe_to_fd(pipefd[0], fd, in))
+					goto error;
+				count += in;
+				goto out;
+			}
+			in -= out;
+			count += out;
+		}
+		mui_set_progress((float)count / (float)len);
 	}
 out:
 	mui_reset_progress();
+	close(pipefd[0]);
+	close(pipefd[1]);
 	return count;
+
+error:
+	mui_reset_progress();
+	close(pipefd[0]);
+	close(pipefd[1]);
+	fastboot_state = STATE_ERROR;
+	return -1;
+}
+
+static int usb_read_to_file(int fd, unsigned int len)
+{
+	unsigned spliced = 0;
+	int ret;
+
+	lseek64(fd, 0, SEEK_SET);
+
+	if (io.can_splice) {
+		ret = usb_splice_to_fd(fd, len);
+		if (ret < 0) {
+			pr_error("fastboot: usb_read_to_file failed\n");
+			return -1;
+		}
+		spliced = ret;
+	}
+
+	if (spliced == len)
+		return len;
+
+	ret = usb_read_stream(len - spliced, write_to_fd, &fd);
+	if (ret) {
+		pr_error("fastboot: usb_read_to_file failed\n");
+		return -1;
+	}
+	return len;
+}
+
+int fastboot_download_stream(unsigned len,
+		int (*consume)(const void *buf, size_t len, void *context),
+		void *context)
+{
+	char response[MAGIC_LENGTH];
+	uint64_t start;
+	int ret;
+
+	if (nested.active) {
+		fastboot_fail("can't receive data here");
+		return -1;
+	}
+
+	pr_status("Receiving %u bytes\n", len);
+	sprintf(response, "DATA%08x", len);
+	if (usb_write(response, strlen(response)) < 0)
+		return -1;
+
+	start = stats_now();
+	ret = usb_read_stream(len, consume, context);
+	if (ret >= 0)
+		stats_download_done(len, start);
+	return ret;
 }
 
 static void fastboot_ack(const char *code, const char *format, va_list ap)
@@ -357,9 +991,22 @@ static void fastboot_ack(const char *code, const char *format, va_list ap)
 	/* Nip off trailing newlines */
 	for (i = strlen(reason); (i > 0) && reason[i - 1] == '\n'; i--)
 		reason[i - 1] = '\0';
+	/* Final responses of nested commands go back to the caller of
+	 * fastboot_run_command(), only INFO reaches the host, and only
+	 * while the outer command hasn't replied */
+	if (nested.active && strcmp(code, "INFO")) {
+		snprintf(nested.response, nested.len, "%s%s", code, reason);
+		pr_debug("nested ack %s %s\n", code, reason);
+		return;
+	}
+	if (nested.active && nested.answered)
+		return;
+
 	snprintf(response, MAGIC_LENGTH, "%s%s", code, reason);
 	pr_debug("ack %s %s\n", code, reason);
 	usb_write(response, MAGIC_LENGTH);
+	if (strcmp(code, "INFO"))
+		stats_command_done(command_start);
 }
 
 void fastboot_info(const char *fmt, ...)
@@ -393,100 +1040,506 @@ void fastboot_okay(const char *fmt, ...)
 	fastboot_state = STATE_COMPLETE;
 }
 
-struct getvar_ctx {
+/* Formatted getvar:all output, rebuilt only when the variables change */
+static struct {
+	bool valid;
+	unsigned gen;
+	size_t count;
 	char **entries;
-	int i;
-};
+} getvar_all_cache;
 
-/* from the qsort man page */
-static int cmpstringp(const void *p1, const void *p2)
+static void getvar_all_refresh(void)
 {
-	return strcmp(* (char * const *) p1, * (char * const *) p2);
+	struct var_table *t;
+	size_t i;
+
+	t = vars_read_begin();
+	if (getvar_all_cache.valid && getvar_all_cache.gen == t->gen) {
+		vars_read_end();
+		return;
+	}
+
+	for (i = 0; i < getvar_all_cache.count; i++)
+		free(getvar_all_cache.entries[i]);
+	free(getvar_all_cache.entries);
+
+	/* The table is sorted already */
+	getvar_all_cache.entries = xmalloc((t->count + 1) * sizeof(char *));
+	for (i = 0; i < t->count; i++)
+		getvar_all_cache.entries[i] = xasprintf("%s: %s",
+				t->vars[i].name, t->vars[i].value);
+	getvar_all_cache.count = t->count;
+	getvar_all_cache.gen = t->gen;
+	getvar_all_cache.valid = true;
+	vars_read_end();
 }
 
-static bool getvar_all_cb(void *key, void *value, void *context)
+static void getvar_info(const char *name, const char *value, void *context)
 {
-	char *keystr = key;
-	char *valstr = value;
-	struct getvar_ctx *ctx = context;
-
-	ctx->entries[ctx->i++] = xasprintf("%s: %s", keystr, valstr);
-	return true;
+	fastboot_info("%s: %s", name, value);
 }
 
 static void cmd_getvar(char *arg, int fd, void *data, unsigned sz)
 {
-	const char *value;
-
 	pr_debug("fastboot: cmd_getvar %s\n", arg);
 	if (!strcmp(arg, "all")) {
-		struct getvar_ctx ctx;
-		int mapsize;
-		int i;
+		size_t i;
+
+		getvar_all_refresh();
+		for (i = 0; i < getvar_all_cache.count; i++)
+			fastboot_info("%s", getvar_all_cache.entries[i]);
+		stats_foreach(getvar_info, NULL);
+		fastboot_okay("");
+	} else {
+		char *value;
 
-		hashmapLock(vars);
-		mapsize = hashmapSize(vars);
+		if (!strncmp(arg, "stats-", strlen("stats-")))
+			value = stats_getvar(arg);
+		else
+			value = fastboot_getvar(arg);
 
-		ctx.entries = calloc(mapsize, sizeof(char *));
-		ctx.i = 0;
+		fastboot_okay("%s", value ? value : "");
+		free(value);
+	}
+}
 
-		hashmapForEach(vars, getvar_all_cb, &ctx);
-		hashmapUnlock(vars);
+/* Downloaded payloads are staged in memory. Each download gets a fresh
+ * memfd, which is sealed once the payload is in and then mapped
+ * read-only, pre-faulted, for the command that consumes it. Kernels
+ * without memfd_create() get an unlinked file in /tmp instead; either
+ * way the file is only reachable through its descriptor. */
+static struct {
+	int fd;
+	void *data;
+	unsigned size;
+	unsigned gen;		/* bumped by every new download */
+	bool complete;		/* all received, possibly 0 bytes */
+	bool sealable;
+	char path[32];
+
+	/* Chunked transfer being assembled in fd, see cmd_download_chunk */
+	bool chunked;
+	unsigned xfer_id;
+	unsigned total;
+	unsigned committed;	/* bytes received with a good checksum */
+} staging = {
+	.fd = -1,
+};
 
-		qsort(ctx.entries, mapsize, sizeof(char *), cmpstringp);
-		for (i = 0; i < mapsize; i++) {
-			fastboot_info("%s", ctx.entries[i]);
-			free(ctx.entries[i]);
-		}
-		free(ctx.entries);
-		fastboot_okay("");
-	} else {
-		value = fastboot_getvar(arg);
-		if (value) {
-			fastboot_okay("%s", value);
-		} else {
-			fastboot_okay("");
+static void publish_transfer(void)
+{
+	fastboot_publish("download-id", staging.chunked ?
+			xasprintf("%x", staging.xfer_id) : xstrdup(""));
+	fastboot_publish("download-committed",
+			xasprintf("0x%x", staging.chunked ? staging.committed : 0));
+}
+
+static void staging_release(void)
+{
+	if (staging.data && munmap(staging.data, staging.size)) {
+		pr_perror("munmap");
+		die();
+	}
+	if (staging.fd >= 0 && close(staging.fd)) {
+		pr_perror("close");
+		die();
+	}
+	staging.fd = -1;
+	staging.data = NULL;
+	staging.size = 0;
+	staging.complete = false;
+
+	if (staging.chunked) {
+		staging.chunked = false;
+		publish_transfer();
+	}
+}
+
+static int staging_create(void)
+{
+	staging_release();
+	staging.gen++;
+
+#ifdef __NR_memfd_create
+	staging.fd = syscall(__NR_memfd_create, "fastboot-download",
+			MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#endif
+	staging.sealable = staging.fd >= 0;
+	if (staging.fd < 0) {
+		pr_verbose("memfd_create unavailable, staging in %s\n",
+				FASTBOOT_DOWNLOAD_TMP_FILE);
+		staging.fd = open(FASTBOOT_DOWNLOAD_TMP_FILE,
+				O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (staging.fd < 0) {
+			pr_error("fastboot: cannot open temp file: %s\n",
+					strerror(errno));
+			return -1;
 		}
+		if (unlink(FASTBOOT_DOWNLOAD_TMP_FILE))
+			pr_perror("unlink");
+	}
+	snprintf(staging.path, sizeof(staging.path), "/proc/self/fd/%d",
+			staging.fd);
+	return 0;
+}
+
+/* Freeze the received payload and map it for the next command */
+static int staging_finish(unsigned len)
+{
+	struct stat sb;
+
+	if (fstat(staging.fd, &sb)) {
+		pr_perror("fstat");
+		return -1;
+	}
+	if (sb.st_size != len) {
+		pr_error("size mismatch! (expected %u vs %" PRIu64 ")\n",
+				len, (uint64_t)sb.st_size);
+		return -1;
+	}
+
+	if (staging.sealable && fcntl(staging.fd, F_ADD_SEALS, F_SEAL_SHRINK |
+				F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL))
+		pr_perror("F_ADD_SEALS");
+
+	staging.complete = true;
+	if (!len)
+		return 0;
+
+	staging.data = mmap64(NULL, len, PROT_READ,
+			MAP_SHARED | MAP_POPULATE, staging.fd, 0);
+	if (staging.data == MAP_FAILED) {
+		pr_perror("mmap64");
+		staging.data = NULL;
+		return -1;
+	}
+	/* Handlers walk images of several GiB, use huge pages if shmem
+	 * has them enabled. The memfd can't be MFD_HUGETLB since hugetlbfs
+	 * doesn't take write() or splice() */
+	madvise(staging.data, len, MADV_HUGEPAGE);
+	staging.size = len;
+	pr_verbose("%u bytes mapped\n", len);
+	return 0;
+}
+
+/* The descriptor handed to a command handler: the staged download read
+ * from its start, or -1 if no download is complete. An unfinished
+ * chunked transfer keeps its offset for the next chunk. */
+static int staging_handler_fd(void)
+{
+	if (!staging.complete)
+		return -1;
+	if (lseek64(staging.fd, 0, SEEK_SET) < 0) {
+		pr_perror("lseek64");
+		return -1;
 	}
+	return staging.fd;
+}
+
+const char *fastboot_download_path(void)
+{
+	if (nested.active && !nested.whole_download)
+		return NULL;
+	return staging.data ? staging.path : NULL;
 }
 
+int fastboot_run_command(const char *command, void *data, unsigned sz,
+		char *response, size_t len)
+{
+	struct fastboot_cmd *cmd;
+	char buf[MAGIC_LENGTH + 1];
+	unsigned outer_state = fastboot_state;
+
+	if (nested.active) {
+		snprintf(response, len, "FAILcommands can't be nested");
+		return -1;
+	}
+
+	memset(buf, 0, sizeof(buf));
+	strncpy(buf, command, MAGIC_LENGTH);
+	for (cmd = cmdlist; cmd; cmd = cmd->next) {
+		if (!memcmp(buf, cmd->prefix, cmd->prefix_len))
+			break;
+	}
+	if (!cmd) {
+		snprintf(response, len, "FAILunknown command");
+		return -1;
+	}
+
+	pr_debug("fastboot: running nested command: %s\n", buf);
+	nested.active = true;
+	nested.answered = outer_state != STATE_COMMAND;
+	nested.whole_download = data == staging.data && sz == staging.size;
+	nested.response = response;
+	nested.len = len;
+	response[0] = '\0';
+
+	fastboot_state = STATE_COMMAND;
+	cmd->handle(buf + cmd->prefix_len,
+			nested.whole_download ? staging_handler_fd() : -1,
+			data, sz);
+	nested.active = false;
+
+	if (fastboot_state == STATE_ERROR)
+		return -1;
+	if (fastboot_state == STATE_COMMAND)
+		snprintf(response, len, "FAILunknown reason");
+	/* The caller still owes the host its own response, unless it
+	 * already sent it, in which case anything more is dropped */
+	fastboot_state = outer_state;
+
+	return strncmp(response, "OKAY", 4) ? -1 : 0;
+}
+
+static int write_to_staging(const void *buf, size_t len, void *context)
+{
+	uint64_t *count = context;
+
+	/* The compressed size was checked, the expanded one can't be
+	 * known until it has been received */
+	if (*count + len > download_max) {
+		pr_error("decompressed download exceeds %lu bytes\n",
+				download_max);
+		return -1;
+	}
+	if (robust_write(staging.fd, buf, len) < 0) {
+		pr_perror("write");
+		return -1;
+	}
+	*count += len;
+	return 0;
+}
+
+static int write_to_decompressor(const void *buf, size_t len, void *context)
+{
+	return decompressor_write(context, buf, len);
+}
+
+/* Returns -1 on transport errors, 1 if the payload couldn't be
+ * decompressed, 0 on success with the expanded size in out_len */
+static int usb_read_compressed(unsigned len, const char *format,
+		unsigned *out_len)
+{
+	struct decompressor *d;
+	uint64_t count = 0;
+	int ret;
+
+	d = decompressor_open(format, write_to_staging, &count);
+	if (!d)
+		return 1;
+
+	ret = usb_read_stream(len, write_to_decompressor, d);
+	if (decompressor_close(d) && !ret)
+		ret = 1;
+	if (!ret)
+		pr_debug("fastboot: %u bytes decompressed to %" PRIu64 "\n",
+				len, count);
+	*out_len = count;
+	return ret;
+}
+
+/* download:<size in hex>[:<compression>]
+ * With a compression format (see the download-compression variable), the
+ * payload is expanded as it arrives and the decompressed data is staged */
 static void cmd_download(char *arg, int fd, void *data, unsigned sz)
 {
 	char response[MAGIC_LENGTH];
-	unsigned len;
+	const char *format = NULL;
+	unsigned len, staged_len;
+	uint64_t start;
+	char *end;
 	int r;
 
-	len = strtoul(arg, NULL, 16);
+	len = strtoul(arg, &end, 16);
+	if (*end == ':')
+		format = end + 1;
 	pr_debug("fastboot: cmd_download %d bytes\n", len);
 	pr_status("Receiving %d bytes\n", len);
 
-	download_size = 0;
+	if (nested.active) {
+		fastboot_fail("can't receive data here");
+		return;
+	}
+
+	staging_release();
 
 	if (len > download_max) {
 		fastboot_fail("data too large");
 		return;
 	}
 
+	if (staging_create()) {
+		fastboot_fail("can't stage download");
+		return;
+	}
+
 	sprintf(response, "DATA%08x", len);
-	if (usb_write(response, strlen(response)) < 0)
+	if (usb_write(response, strlen(response)) < 0) {
+		staging_release();
 		return;
+	}
 
-	r = usb_read_to_file(fd, len);
+	start = stats_now();
+	if (format) {
+		r = usb_read_compressed(len, format, &staged_len);
+		if (r > 0) {
+			staging_release();
+			fastboot_fail("can't decompress download");
+			return;
+		}
+	} else {
+		r = usb_read_to_file(staging.fd, len);
+		if (r >= 0 && (unsigned int)r != len)
+			r = -1;
+		staged_len = len;
+	}
 
-	if ((r < 0) || ((unsigned int)r != len)) {
-		pr_error("fastboot: cmd_download error only got %d bytes\n", r);
+	if (r < 0) {
+		pr_error("fastboot: cmd_download error\n");
+		staging_release();
 		fastboot_state = STATE_ERROR;
 		return;
 	}
-	download_size = len;
+	stats_download_done(len, start);
+
+	if (staging_finish(staged_len)) {
+		staging_release();
+		fastboot_fail("can't stage download");
+		return;
+	}
 	fastboot_okay("");
 }
 
+struct chunk_ctx {
+	off64_t pos;
+	uLong crc;
+};
+
+static int write_chunk(const void *buf, size_t len, void *context)
+{
+	struct chunk_ctx *ctx = context;
+	const unsigned char *pos = buf;
+
+	ctx->crc = crc32(ctx->crc, buf, len);
+	while (len) {
+		ssize_t ret = pwrite64(staging.fd, pos, len, ctx->pos);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_perror("pwrite64");
+			return -1;
+		}
+		pos += ret;
+		len -= ret;
+		ctx->pos += ret;
+	}
+	return 0;
+}
+
+/* download-chunk:<id>:<total>:<offset>:<len>:<crc32>, all in hex.
+ * Receives part of a download of total bytes, which only counts once its
+ * CRC32 checks out. A transfer survives the connection being lost; after
+ * reconnecting, the host reads the download-id and download-committed
+ * variables and continues from the committed offset. Once every byte is
+ * in, the result is staged exactly as if it had come from download: */
+static void cmd_download_chunk(char *arg, int fd, void *data, unsigned sz)
+{
+	struct chunk_ctx ctx;
+	unsigned id, total, offset, len, crc;
+	char response[MAGIC_LENGTH];
+	uint64_t start;
+	int r;
+
+	if (nested.active) {
+		fastboot_fail("can't receive data here");
+		return;
+	}
+
+	if (sscanf(arg, "%x:%x:%x:%x:%x", &id, &total, &offset, &len,
+				&crc) != 5) {
+		fastboot_fail("bad arguments");
+		return;
+	}
+
+	if (total > download_max) {
+		fastboot_fail("data too large");
+		return;
+	}
+	if (offset > total || len > total - offset) {
+		fastboot_fail("chunk outside of transfer");
+		return;
+	}
+
+	if (!staging.chunked || staging.xfer_id != id ||
+			staging.total != total) {
+		if (offset) {
+			fastboot_fail("unknown transfer, start from offset 0");
+			return;
+		}
+		if (staging_create()) {
+			fastboot_fail("can't stage download");
+			return;
+		}
+		pr_debug("fastboot: new chunked transfer %x of %u bytes\n",
+				id, total);
+		staging.chunked = true;
+		staging.xfer_id = id;
+		staging.total = total;
+		staging.committed = 0;
+		publish_transfer();
+	}
+
+	if (offset != staging.committed) {
+		fastboot_fail("expected offset 0x%x", staging.committed);
+		return;
+	}
+
+	pr_debug("fastboot: chunk %x+%x of transfer %x\n", offset, len, id);
+	sprintf(response, "DATA%08x", len);
+	if (usb_write(response, strlen(response)) < 0)
+		return;
+
+	ctx.pos = offset;
+	ctx.crc = crc32(0L, Z_NULL, 0);
+	start = stats_now();
+	r = usb_read_stream(len, write_chunk, &ctx);
+	if (r < 0) {
+		/* Transfer is kept, the host can resume after reconnecting */
+		pr_error("fastboot: chunk receive failed, %u bytes committed\n",
+				staging.committed);
+		return;
+	}
+	stats_download_done(len, start);
+	if (r) {
+		fastboot_fail("can't write chunk");
+		return;
+	}
+	if (ctx.crc != crc) {
+		pr_error("chunk %x+%x crc32 %08lx, expected %08x\n", offset,
+				len, ctx.crc, crc);
+		fastboot_fail("checksum mismatch");
+		return;
+	}
+
+	staging.committed += len;
+	publish_transfer();
+
+	if (staging.committed == total) {
+		if (staging_finish(total)) {
+			staging_release();
+			fastboot_fail("can't stage download");
+			return;
+		}
+	}
+	fastboot_okay("0x%x", staging.committed);
+}
+
 static void fastboot_command_loop(void)
 {
 	struct fastboot_cmd *cmd;
 	int r;
-	int fd = -1;
+	unsigned gen;
+	bool staged;
 	void *data;
 
 	pr_debug("fastboot: processing commands\n");
@@ -498,6 +1551,7 @@ again:
 		if (r < 0)
 			break;
 		buffer[r] = 0;
+		command_start = stats_now();
 		pr_debug("fastboot got command: %s\n", buffer);
 
 		for (cmd = cmdlist; cmd; cmd = cmd->next) {
@@ -505,62 +1559,22 @@ again:
 				continue;
 			fastboot_state = STATE_COMMAND;
 
-			fd = open(FASTBOOT_DOWNLOAD_TMP_FILE, O_RDWR | O_CREAT, 0600);
-			if (fd < 0) {
-				pr_error("fastboot: cannot open temp file: %s\n",
-					strerror(errno));
-				die();
-			}
-
-			if (download_size) {
-				struct stat sb;
-				if (fstat(fd, &sb)) {
-					pr_perror("fstat");
-					die();
-				}
-
-				if (sb.st_size != download_size) {
-					pr_error("size mismatch! (expected %u vs %" PRIu64 ")\n",
-							download_size, sb.st_size);
-					die();
-				}
-
-				data = mmap64(NULL, download_size, PROT_READ, MAP_SHARED, fd, 0);
-				if (data == (void*)-1) {
-					pr_perror("mmap64");
-					die();
-				}
-				pr_verbose("%u bytes mapped\n", download_size);
-			} else {
-				pr_verbose("nothing to mmap\n");
-				data = NULL;
-			}
+			data = staging.data;
+			staged = staging.complete;
+			gen = staging.gen;
 
 			pthread_mutex_lock(&action_mutex);
 			pr_verbose("enter command handler\n");
 			cmd->handle((char *)buffer + cmd->prefix_len,
-				    fd, data, download_size);
+				    staging_handler_fd(), data, staging.size);
 			pr_verbose("exit command handler\n");
 			pthread_mutex_unlock(&action_mutex);
 
-			if (data && munmap(data, download_size)) {
-				pr_perror("munmap");
-				die();
-			}
-
-			if (close(fd)) {
-				pr_perror("close");
-				die();
-			}
-
-			if (data) {
-				download_size = 0;
-				pr_verbose("deleting temp file\n");
-
-				if (unlink(FASTBOOT_DOWNLOAD_TMP_FILE)) {
-					pr_perror("unlink");
-					die();
-				}
+			/* A download is consumed by the command that follows
+			 * it, unless that command was another download */
+			if (staged && staging.gen == gen) {
+				pr_verbose("releasing download buffer\n");
+				staging_release();
 			}
 
 			if (fastboot_state == STATE_COMMAND)
@@ -620,11 +1634,14 @@ static int open_usb_fd(void)
 	io.read_fp = open(USB_ADB_PATH, O_RDWR);
 	/* tip to reuse same usb_read() and usb_write() than ffs */
 	io.write_fp = io.read_fp;
+	io.max_read = ADB_MAX_READ;
 
 	return io.read_fp;
 }
 static int open_usb_ffs(void)
 {
+	struct desc_v1 v1_descriptor;
+	struct desc_v2 v2_descriptor;
 	ssize_t ret;
 	int control_fp;
 
@@ -634,10 +1651,34 @@ static int open_usb_ffs(void)
 		goto err;
 	}
 
-	ret = write(control_fp, &descriptors, sizeof(descriptors));
+	v2_descriptor.header.magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2);
+	v2_descriptor.header.length = cpu_to_le32(sizeof(v2_descriptor));
+	v2_descriptor.header.flags = cpu_to_le32(FUNCTIONFS_HAS_FS_DESC |
+			FUNCTIONFS_HAS_HS_DESC | FUNCTIONFS_HAS_SS_DESC);
+	v2_descriptor.fs_count = cpu_to_le32(3);
+	v2_descriptor.hs_count = cpu_to_le32(3);
+	v2_descriptor.ss_count = cpu_to_le32(5);
+	v2_descriptor.fs_descs = fs_descriptors;
+	v2_descriptor.hs_descs = hs_descriptors;
+	v2_descriptor.ss_descs = ss_descriptors;
+
+	ret = write(control_fp, &v2_descriptor, sizeof(v2_descriptor));
 	if (ret < 0) {
-		pr_info("[ %s: write descriptors failed: errno=%d ]\n", USB_FFS_ADB_EP0, errno);
-		goto err;
+		pr_debug("[ %s: write v2 descriptors failed: errno=%d, no SuperSpeed ]\n",
+				USB_FFS_ADB_EP0, errno);
+
+		v1_descriptor.header.magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC);
+		v1_descriptor.header.length = cpu_to_le32(sizeof(v1_descriptor));
+		v1_descriptor.header.fs_count = cpu_to_le32(3);
+		v1_descriptor.header.hs_count = cpu_to_le32(3);
+		v1_descriptor.fs_descs = fs_descriptors;
+		v1_descriptor.hs_descs = hs_descriptors;
+
+		ret = write(control_fp, &v1_descriptor, sizeof(v1_descriptor));
+		if (ret < 0) {
+			pr_info("[ %s: write descriptors failed: errno=%d ]\n", USB_FFS_ADB_EP0, errno);
+			goto err;
+		}
 	}
 
 	ret = write(control_fp, &strings, sizeof(strings));
@@ -658,6 +1699,14 @@ static int open_usb_ffs(void)
 		goto err;
 	}
 
+	io.max_read = FFS_AIO_REQ_SIZE;
+	io.aio_ctx = 0;
+	if (io_setup(FFS_AIO_DEPTH, &io.aio_ctx)) {
+		pr_debug("io_setup failed (%s), using synchronous reads\n",
+				strerror(errno));
+		io.aio_ctx = 0;
+	}
+
 	pr_info("Fastboot opened on %s\n", USB_FFS_ADB_PATH);
 
 	close(control_fp);
@@ -720,6 +1769,11 @@ static int open_usb(void)
  * */
 void close_iofds(void)
 {
+	if (io.aio_ctx) {
+		io_destroy(io.aio_ctx);
+		io.aio_ctx = 0;
+	}
+	io.can_splice = false;
 	if (io.write_fp > 0) {
 		close(io.write_fp);
 		io.write_fp = -1;
@@ -777,6 +1831,8 @@ int fastboot_handler(void)
 				pr_error("Accept failure: %s\n", strerror(errno));
 			else {
 				io.write_fp = io.read_fp;
+				io.max_read = XFER_MEM_SIZE;
+				io.can_splice = true;
 				fastboot_command_loop();
 			}
 			close_iofds();
@@ -785,24 +1841,16 @@ int fastboot_handler(void)
 	return 0;
 }
 
-static int str_hash(void *key)
-{
-	return hashmapHash(key, strlen(key));
-}
-
-static bool str_equals(void *keyA, void *keyB)
-{
-	return strcmp(keyA, keyB) == 0;
-}
-
 int fastboot_init(unsigned long size)
 {
 	pr_verbose("fastboot_init()\n");
 	download_max = size;
-	vars = hashmapCreate(128, str_hash, str_equals);
 	fastboot_register("getvar:", cmd_getvar);
 	fastboot_register("download:", cmd_download);
+	fastboot_register("download-chunk:", cmd_download_chunk);
 	fastboot_publish("max-download-size", xasprintf("0x%lX", download_max));
+	fastboot_publish("download-compression", xstrdup(DECOMPRESSOR_FORMATS));
+	publish_transfer();
 	fastboot_pid = gettid();
 
 	return 0;
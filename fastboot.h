@@ -28,6 +28,9 @@
 
 #ifndef __APP_FASTBOOT_H
 #define __APP_FASTBOOT_H
+
+#include <stddef.h>
+
 #define FASTBOOT_DOWNLOAD_TMP_FILE "/tmp/fstboot.img"
 
 /* Initialize fastboot protocol */
@@ -44,7 +47,34 @@ int fastboot_handler(void);
 void fastboot_register(const char *prefix,
                        void (*handle)(char *arg, int fd, void *data, unsigned size));
 
-/* Fetch the value of a fastboot_publish variable */
+/* Only callable from within a command handler. Accept a len byte
+ * payload from the host like download: does, but instead of staging it,
+ * hand it to consume() in order as it arrives. If consume() fails, the
+ * rest of the payload is still received and discarded.
+ * Returns -1 on transport errors, after which no response may be sent;
+ * 1 if consume() failed; 0 on success */
+int fastboot_download_stream(unsigned len,
+		int (*consume)(const void *buf, size_t len, void *context),
+		void *context);
+
+/* Path through which the staged download can be opened by name, for
+ * code that can't work from the handler's data/fd arguments. Only valid
+ * within the handler the download was passed to; NULL if there is none */
+const char *fastboot_download_path(void);
+
+/* Only callable from within a command handler. Run command as if the
+ * host had sent it, with data/sz standing in for the staged download.
+ * Its final OKAY/FAIL is written to response (as it would go out on the
+ * wire, e.g. "FAILtarget partition too small!") instead of being sent;
+ * INFO messages still reach the host, unless the calling handler already
+ * replied, after which nothing more is sent for it. Commands that need to
+ * receive data from the host fail. Returns 0 if the command replied OKAY,
+ * -1 otherwise or if the transport went away meanwhile. */
+int fastboot_run_command(const char *command, void *data, unsigned sz,
+		char *response, size_t len);
+
+/* Fetch a copy of the value of a fastboot_publish variable, to be freed
+ * by the caller. NULL if there is no such variable. */
 char *fastboot_getvar(char *name);
 
 /* only callable from within a command handler */
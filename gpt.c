@@ -24,6 +24,7 @@
 #include <linux/fs.h>
 #include <stdbool.h>
 #include <inttypes.h>
+#include <unistd.h>
 
 #include <cutils/hashmap.h>
 #include <iniparser.h>
@@ -277,6 +278,39 @@ static bool create_ptn_cb(char *entry, int i _unused, void *data)
 
 #define MIN_DATA_PART_SIZE	350 /* CDD section 7.6.1 */
 
+#define GPT_CONFIG_TMP_FILE	"/tmp/gpt.ini"
+
+/* iniparser only reads files. A manifest step gets a slice of the
+ * download, which has no file of its own, so copy it into one. */
+static dictionary *load_config(void *data, unsigned sz)
+{
+	const char *path = fastboot_download_path();
+	dictionary *config = NULL;
+	char fd_path[32];
+	int fd;
+
+	if (path)
+		return iniparser_load(path);
+
+	fd = open(GPT_CONFIG_TMP_FILE, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+			0600);
+	if (fd < 0) {
+		pr_perror("open " GPT_CONFIG_TMP_FILE);
+		return NULL;
+	}
+	if (unlink(GPT_CONFIG_TMP_FILE))
+		pr_perror("unlink");
+	if (robust_write(fd, data, sz) < 0) {
+		pr_error("couldn't write GPT config\n");
+		goto out;
+	}
+	snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+	config = iniparser_load(fd_path);
+out:
+	close(fd);
+	return config;
+}
+
 int cmd_flash_gpt(Hashmap *params, int fd, void *data, unsigned sz)
 {
 	int ret = -1;
@@ -287,7 +321,12 @@ int cmd_flash_gpt(Hashmap *params, int fd, void *data, unsigned sz)
 
 	memset(&ctx, 0, sizeof(ctx));
 
-	ctx.config = iniparser_load(FASTBOOT_DOWNLOAD_TMP_FILE);
+	if (!data) {
+		pr_error("No GPT config downloaded\n");
+		return -1;
+	}
+
+	ctx.config = load_config(data, sz);
 	if (!ctx.config) {
 		pr_error("Couldn't parse GPT config\n");
 		return -1;
@@ -37,7 +37,10 @@
 #include <openssl/sha.h>
 #include <openssl/evp.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <ftw.h>
 
 #include <bootimg.h>
@@ -51,6 +54,28 @@
 
 #define BOOT_SIGNATURE_MAX_SIZE  2048
 
+/* Spacing of the SHA-1 states kept by image_hash */
+#define SNAPSHOT_INTERVAL	(1024 * 1024)
+
+struct image_hash {
+	SHA256_CTX sha256;
+	SHA_CTX sha1;
+	uint64_t len;		/* bytes hashed */
+	bool stopped;
+
+	/* SHA-1 state at each multiple of SNAPSHOT_INTERVAL up to len */
+	SHA_CTX *snapshots;
+	size_t nsnapshots;
+	size_t max_snapshots;
+
+	/* once committed */
+	char *ptn;
+	char *device;
+	struct image_hash *next;
+};
+
+static struct image_hash *flashed_images;
+
 static void report_hash(const char *name, unsigned char *hash)
 {
 	char *hashstr = xmalloc(SHA_DIGEST_LENGTH * 2 + 1);
@@ -64,7 +89,7 @@ static void report_hash(const char *name, unsigned char *hash)
 	free(hashstr);
 }
 
-static int open_partition(const char *ptn)
+static int open_partition(const char *ptn, const char **device)
 {
 	struct fstab_rec *vol;
 	int fd;
@@ -78,29 +103,201 @@ static int open_partition(const char *ptn)
 	fd = open(vol->blk_device, O_RDONLY);
 	if (fd < 0)
 		pr_perror("open");
+	*device = vol->blk_device;
 	return fd;
 }
 
+
+struct image_hash *image_hash_new(void)
+{
+	struct image_hash *h;
+
+	h = xmalloc(sizeof(*h));
+	memset(h, 0, sizeof(*h));
+	SHA256_Init(&h->sha256);
+	SHA1_Init(&h->sha1);
+	return h;
+}
+
+
+static void snapshot(struct image_hash *h)
+{
+	if (h->nsnapshots == h->max_snapshots) {
+		h->max_snapshots = h->max_snapshots ? h->max_snapshots * 2 : 64;
+		h->snapshots = realloc(h->snapshots,
+				h->max_snapshots * sizeof(SHA_CTX));
+		if (!h->snapshots)
+			die();
+	}
+	h->snapshots[h->nsnapshots++] = h->sha1;
+}
+
+
+void image_hash_update(struct image_hash *h, const void *data, size_t len)
+{
+	const unsigned char *pos = data;
+
+	while (len && !h->stopped) {
+		size_t n = min(len, (size_t)(SNAPSHOT_INTERVAL -
+					h->len % SNAPSHOT_INTERVAL));
+
+		if (!(h->len % SNAPSHOT_INTERVAL))
+			snapshot(h);
+		SHA256_Update(&h->sha256, pos, n);
+		SHA1_Update(&h->sha1, pos, n);
+		h->len += n;
+		pos += n;
+		len -= n;
+	}
+}
+
+
+void image_hash_fill(struct image_hash *h, uint32_t val, uint64_t len)
+{
+	uint32_t pattern[1024];
+	size_t i;
+
+	for (i = 0; i < sizeof(pattern) / sizeof(pattern[0]); i++)
+		pattern[i] = val;
+	while (len && !h->stopped) {
+		size_t n = min(len, (uint64_t)sizeof(pattern));
+
+		image_hash_update(h, pattern, n);
+		len -= n;
+	}
+}
+
+
+void image_hash_stop(struct image_hash *h)
+{
+	h->stopped = true;
+}
+
+
+void image_hash_free(struct image_hash *h)
+{
+	if (!h)
+		return;
+	free(h->snapshots);
+	free(h->ptn);
+	free(h->device);
+	free(h);
+}
+
+
+static void unpublish(struct image_hash *h)
+{
+	char *name = xasprintf("image-sha256:%s", h->ptn);
+
+	fastboot_publish(name, xstrdup("unknown"));
+	free(name);
+}
+
+
+void image_hash_forget(const char *device)
+{
+	struct image_hash **pos = &flashed_images;
+
+	while (*pos) {
+		struct image_hash *h = *pos;
+
+		if (device && strcmp(h->device, device)) {
+			pos = &h->next;
+			continue;
+		}
+		*pos = h->next;
+		unpublish(h);
+		image_hash_free(h);
+	}
+}
+
+
+void image_hash_commit(struct image_hash *h, const char *ptn,
+		const char *device)
+{
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	char *name, *value;
+	int i;
+
+	image_hash_forget(device);
+	h->ptn = xstrdup(ptn);
+	h->device = xstrdup(device);
+	h->next = flashed_images;
+	flashed_images = h;
+
+	/* Past a skipped region, the SHA-256 would describe neither the
+	 * image nor what is on the device */
+	if (h->stopped) {
+		unpublish(h);
+		return;
+	}
+
+	SHA256_Final(digest, &h->sha256);
+	value = xmalloc(SHA256_DIGEST_LENGTH * 2 + 1);
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+		snprintf(value + i * 2, 3, "%02x", digest[i]);
+	name = xasprintf("image-sha256:%s", ptn);
+	fastboot_publish(name, value);
+	free(name);
+}
+
+
+/* Find the SHA-1 state of device's contents at the latest known offset
+ * up to len, if it was flashed by us */
+static uint64_t cached_prefix(const char *device, uint64_t len,
+		SHA_CTX *ctx)
+{
+	struct image_hash *h;
+	size_t i;
+
+	for (h = flashed_images; h; h = h->next) {
+		if (strcmp(h->device, device))
+			continue;
+		if (len >= h->len) {
+			*ctx = h->sha1;
+			return h->len;
+		}
+		i = len / SNAPSHOT_INTERVAL;
+		if (i >= h->nsnapshots)
+			return 0;
+		*ctx = h->snapshots[i];
+		return i * (uint64_t)SNAPSHOT_INTERVAL;
+	}
+	return 0;
+}
+
 #define CHUNK 1024 * 1024
 
-static int hash_fd(int fd, uint64_t len, unsigned char *hash)
+/* SHA-1 of the first len bytes of fd. If it is the device node of a
+ * partition we flashed, only what wasn't hashed while flashing is read */
+static int hash_fd(int fd, uint64_t len, unsigned char *hash,
+		const char *device)
 {
 	unsigned char *blob;
 	ssize_t chunklen;
 	SHA_CTX sha_ctx;
 	int ret = -1;
-	uint64_t orig_len = len;
+	uint64_t start = 0;
+	uint64_t orig_len;
+
+	SHA1_Init(&sha_ctx);
+	if (device) {
+		start = cached_prefix(device, len, &sha_ctx);
+		if (start)
+			pr_debug("%s: first %" PRIu64 " bytes hashed while flashing\n",
+					device, start);
+	}
+	len -= start;
+	orig_len = len;
 
 	blob = xmalloc(CHUNK);
 	mui_show_progress(1.0, 0);
 
-	if (lseek64(fd, 0, SEEK_SET) < 0) {
+	if (lseek64(fd, start, SEEK_SET) < 0) {
 		pr_perror("lseek64");
 		goto out;
 	}
 
-	SHA1_Init(&sha_ctx);
-
 	while (len) {
 		mui_set_progress((float)(orig_len - len)/(float)orig_len);
 		chunklen = read(fd, blob, min(CHUNK, len));
@@ -206,7 +403,7 @@ static int ftw_callback(const char *fpath, const struct stat *sb, int typeflag)
 	if (fd < 0)
 		return 0;
 
-	if (!hash_fd(fd, sb->st_size, hash))
+	if (!hash_fd(fd, sb->st_size, hash, NULL))
 		report_hash(fpath + 5, hash);
 	close(fd);
 	return 0;
@@ -242,8 +439,7 @@ out:
 
 int get_boot_image_hash(const char *ptn)
 {
-	char *device;
-	struct fstab_rec *vol;
+	const char *device;
 	int fd = -1;
 	int ret = -1;
 	int64_t len;
@@ -251,7 +447,7 @@ int get_boot_image_hash(const char *ptn)
 
 	pr_status("Hashing boot image /%s\n", ptn);
 
-	fd = open_partition(ptn);
+	fd = open_partition(ptn, &device);
 	if (fd < 0)
 		goto out;
 
@@ -259,7 +455,7 @@ int get_boot_image_hash(const char *ptn)
 	if (len < 0)
 		goto out;
 
-	if (hash_fd(fd, len, hash))
+	if (hash_fd(fd, len, hash, device))
 		goto out;
 
 	report_hash(ptn, hash);
@@ -321,6 +517,7 @@ uint64_t verity_tree_size(uint64_t data_size)
 
 int get_ext_image_hash(const char *ptn)
 {
+	const char *device;
 	int fd = -1;
 	int ret = -1;
 	uint64_t len;
@@ -330,7 +527,7 @@ int get_ext_image_hash(const char *ptn)
 
 	pr_status("Hashing ext image /%s\n", ptn);
 
-	fd = open_partition(ptn);
+	fd = open_partition(ptn, &device);
 	if (fd < 0)
 		goto out;
 
@@ -373,7 +570,7 @@ int get_ext_image_hash(const char *ptn)
 	len += verity_tree_size(len) + VERITY_METADATA_SIZE;
 
 	pr_debug("%s filesystem size %lld\n", ptn, len);
-	if (hash_fd(fd, len, hash))
+	if (hash_fd(fd, len, hash, device))
 		goto out;
 
 	report_hash(ptn, hash);
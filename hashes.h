@@ -33,8 +33,38 @@
 #ifndef _HASHES_H_
 #define _HASHES_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 int get_fat_file_hashes(const char *ptn);
 int get_boot_image_hash(const char *ptn);
 int get_ext_image_hash(const char *ptn);
 
+/* Hashing of images while they are flashed. The SHA-256 of the image is
+ * published as image-sha256:<partition>, and the SHA-1 state is kept at
+ * regular offsets so that get-hashes only has to read what lies past the
+ * last one before the end of the area it hashes, instead of all of it. */
+struct image_hash;
+
+struct image_hash *image_hash_new(void);
+void image_hash_update(struct image_hash *h, const void *data, size_t len);
+void image_hash_fill(struct image_hash *h, uint32_t val, uint64_t len);
+
+/* The output no longer matches what is on the device past this point,
+ * such as when a sparse image skips over a region. Nothing is kept
+ * for what follows, so a sparse image only gains up to its first
+ * DONT_CARE chunk, which for filesystem images tends to come early;
+ * the device holds whatever it did before in the gap, zeroes only if
+ * the discard happened to leave them. */
+void image_hash_stop(struct image_hash *h);
+
+/* The image made it to the device: remember its hashes for the device
+ * node and publish them. Takes ownership of h. */
+void image_hash_commit(struct image_hash *h, const char *ptn,
+		const char *device);
+void image_hash_free(struct image_hash *h);
+
+/* Something else wrote to device, or to any device if NULL */
+void image_hash_forget(const char *device);
+
 #endif
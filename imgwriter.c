@@ -0,0 +1,483 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sparse_format.h>
+#include <zlib.h>
+
+#include "imgwriter.h"
+#include "blkio.h"
+#include "hashes.h"
+#include "userfastboot_ui.h"
+#include "userfastboot_util.h"
+
+/* Largest file or chunk header we are prepared to buffer. libsparse
+ * only ever generates the minimum sizes, but the format allows more */
+#define MAX_HDR_SIZE	256
+
+enum iw_state {
+	IW_MAGIC,	/* collecting enough bytes to tell raw from sparse */
+	IW_RAW,		/* plain image, copied through as-is */
+	IW_SPARSE_HDR,	/* collecting the sparse file header */
+	IW_CHUNK_HDR,	/* collecting a chunk header */
+	IW_CHUNK_DATA,	/* copying a CHUNK_TYPE_RAW payload */
+	IW_CHUNK_FILL,	/* collecting the 32-bit fill value */
+	IW_CHUNK_CRC,	/* collecting a CHUNK_TYPE_CRC32 payload */
+	IW_DONE,
+	IW_ERROR
+};
+
+struct imgwriter {
+	int fd;
+	char *device;
+	uint64_t devsize;
+	uint64_t pos;		/* device offset of the next output byte */
+	enum iw_state state;
+
+	unsigned char hdr[MAX_HDR_SIZE];
+	size_t hdr_len;
+	size_t hdr_need;
+	uint64_t skip;		/* input bytes to drop before the next state */
+
+	sparse_header_t sh;
+	uint64_t out_end;	/* expanded size of the sparse image */
+	uint32_t chunks_left;
+	uint64_t chunk_left;	/* output bytes left in the current chunk */
+	uint32_t fill_val;
+
+	bool check_crc;
+	uint32_t crc;		/* of the output so far, skipped areas as zeroes */
+	struct image_hash *hash;
+
+	/* Output is gathered in blkio buffers, which are queued once full
+	 * or when the image skips ahead */
+	struct blkio *io;
+	unsigned flags;
+	unsigned char *buf;
+	size_t buf_len;
+	uint64_t buf_off;
+};
+
+
+struct imgwriter *imgwriter_open(const char *device, uint64_t devsize,
+		enum blkio_mode mode, unsigned flags)
+{
+	struct imgwriter *w;
+
+	w = xmalloc(sizeof(*w));
+	memset(w, 0, sizeof(*w));
+
+	w->fd = open(device, blkio_open_flags(mode, flags));
+	if (w->fd < 0) {
+		pr_error("Couldn't open %s: %s\n", device, strerror(errno));
+		free(w);
+		return NULL;
+	}
+	w->device = xstrdup(device);
+	w->devsize = devsize;
+	w->io = blkio_open_mode(w->fd, 0, mode, flags);
+	w->flags = flags;
+	w->state = IW_MAGIC;
+	w->hdr_need = sizeof(uint32_t);
+	return w;
+}
+
+
+void imgwriter_check_crc(struct imgwriter *w)
+{
+	w->check_crc = true;
+	w->crc = crc32(0, NULL, 0);
+}
+
+
+void imgwriter_set_hash(struct imgwriter *w, struct image_hash *h)
+{
+	w->hash = h;
+}
+
+
+/* Add len bytes of a repeated 32-bit pattern to the CRC */
+static void crc_fill(struct imgwriter *w, uint32_t val, uint64_t len)
+{
+	uint32_t pattern[1024];
+	size_t i;
+
+	for (i = 0; i < sizeof(pattern) / sizeof(pattern[0]); i++)
+		pattern[i] = val;
+	while (len) {
+		size_t n = min(len, (uint64_t)sizeof(pattern));
+
+		w->crc = crc32(w->crc, (unsigned char *)pattern, n);
+		len -= n;
+	}
+}
+
+
+static void expect(struct imgwriter *w, enum iw_state state, size_t need)
+{
+	w->state = state;
+	w->hdr_len = 0;
+	w->hdr_need = need;
+}
+
+
+/* Accumulate header bytes, returns true once hdr_need bytes are in */
+static bool collect(struct imgwriter *w, const unsigned char **data,
+		size_t *len)
+{
+	size_t n = min(*len, w->hdr_need - w->hdr_len);
+
+	memcpy(w->hdr + w->hdr_len, *data, n);
+	w->hdr_len += n;
+	*data += n;
+	*len -= n;
+	return w->hdr_len == w->hdr_need;
+}
+
+
+static int flush(struct imgwriter *w)
+{
+	int ret;
+
+	if (!w->buf)
+		return 0;
+	ret = blkio_write(w->io, w->buf, w->buf_len, w->buf_off);
+	w->buf = NULL;
+	w->buf_len = 0;
+	if (ret)
+		pr_error("Failed to write to %s\n", w->device);
+	return ret;
+}
+
+
+/* Append to the output at w->pos. With fill set, data is a single
+ * 32-bit pattern to repeat instead of len bytes. */
+static int gather(struct imgwriter *w, const void *data, uint64_t len,
+		bool fill)
+{
+	const unsigned char *pos = data;
+
+	if (w->pos + len > w->devsize) {
+		pr_error("image too large for %s\n", w->device);
+		return -1;
+	}
+
+	while (len) {
+		size_t n;
+
+		if (w->buf && w->buf_off + w->buf_len != w->pos && flush(w))
+			return -1;
+		if (!w->buf) {
+			w->buf = blkio_get_buffer(w->io);
+			w->buf_off = w->pos;
+		}
+
+		n = min(len, (uint64_t)(BLKIO_BUF_SIZE - w->buf_len));
+		if (fill) {
+			/* Offsets are all block aligned, so is the pattern */
+			uint32_t *out = (uint32_t *)(w->buf + w->buf_len);
+			size_t i;
+
+			for (i = 0; i < n / sizeof(uint32_t); i++)
+				out[i] = *(const uint32_t *)data;
+		} else {
+			memcpy(w->buf + w->buf_len, pos, n);
+			pos += n;
+		}
+		w->buf_len += n;
+		w->pos += n;
+		len -= n;
+
+		if (w->buf_len == BLKIO_BUF_SIZE && flush(w))
+			return -1;
+	}
+	return 0;
+}
+
+
+static int output(struct imgwriter *w, const void *buf, size_t len)
+{
+	if (w->hash)
+		image_hash_update(w->hash, buf, len);
+	return gather(w, buf, len, false);
+}
+
+
+static int output_fill(struct imgwriter *w, uint32_t val, uint64_t len)
+{
+	if (w->check_crc)
+		crc_fill(w, val, len);
+	if (w->hash)
+		image_hash_fill(w->hash, val, len);
+
+	/* Zero fills, the bulk of most filesystem images, are left to the
+	 * block layer when they are aligned well enough. Delta writes
+	 * compare them instead, they are likely zero already. */
+	if (!val && !((w->pos | len) % BLKIO_ALIGN) &&
+			!(w->flags & BLKIO_DELTA)) {
+		if (flush(w) || blkio_zero(w->io, w->pos, len)) {
+			pr_error("Failed to zero out %s\n", w->device);
+			return -1;
+		}
+		w->pos += len;
+		return 0;
+	}
+	w->fill_val = val;
+	return gather(w, &w->fill_val, len, true);
+}
+
+
+static void next_chunk(struct imgwriter *w)
+{
+	if (w->chunks_left)
+		expect(w, IW_CHUNK_HDR, w->sh.chunk_hdr_sz);
+	else
+		w->state = IW_DONE;
+}
+
+
+static int start_sparse(struct imgwriter *w)
+{
+	memcpy(&w->sh, w->hdr, sizeof(w->sh));
+
+	if (w->sh.major_version != SPARSE_HEADER_MAJOR_VER ||
+			w->sh.file_hdr_sz < SPARSE_HEADER_LEN ||
+			w->sh.chunk_hdr_sz < CHUNK_HEADER_LEN ||
+			w->sh.chunk_hdr_sz > MAX_HDR_SIZE ||
+			!w->sh.blk_sz || w->sh.blk_sz % sizeof(uint32_t)) {
+		pr_error("unsupported sparse image header\n");
+		return -1;
+	}
+
+	w->out_end = (uint64_t)w->sh.blk_sz * w->sh.total_blks;
+	pr_debug("Streaming sparse image, %u chunks, total size %" PRIu64 " MiB\n",
+			w->sh.total_chunks, w->out_end >> 20);
+	if (w->out_end > w->devsize) {
+		pr_error("need %" PRIu64 " bytes, have %" PRIu64 " available\n",
+				w->out_end, w->devsize);
+		return -1;
+	}
+
+	w->chunks_left = w->sh.total_chunks;
+	w->skip = w->sh.file_hdr_sz - SPARSE_HEADER_LEN;
+	next_chunk(w);
+	return 0;
+}
+
+
+static int start_chunk(struct imgwriter *w)
+{
+	chunk_header_t ch;
+	uint64_t payload;
+
+	memcpy(&ch, w->hdr, sizeof(ch));
+	w->chunks_left--;
+
+	if (ch.total_sz < w->sh.chunk_hdr_sz) {
+		pr_error("corrupt sparse chunk header\n");
+		return -1;
+	}
+	payload = ch.total_sz - w->sh.chunk_hdr_sz;
+	w->chunk_left = (uint64_t)ch.chunk_sz * w->sh.blk_sz;
+	if (w->pos + w->chunk_left > w->out_end) {
+		pr_error("sparse chunk runs past the end of the image\n");
+		return -1;
+	}
+
+	switch (ch.chunk_type) {
+	case CHUNK_TYPE_RAW:
+		if (payload != w->chunk_left)
+			goto bad_size;
+		w->state = IW_CHUNK_DATA;
+		if (!w->chunk_left)
+			next_chunk(w);
+		break;
+	case CHUNK_TYPE_FILL:
+		if (payload != sizeof(uint32_t))
+			goto bad_size;
+		expect(w, IW_CHUNK_FILL, sizeof(uint32_t));
+		break;
+	case CHUNK_TYPE_DONT_CARE:
+		if (payload)
+			goto bad_size;
+		if (blkio_discard(w->io, w->pos, w->chunk_left))
+			return -1;
+		if (w->check_crc)
+			crc_fill(w, 0, w->chunk_left);
+		if (w->hash && w->chunk_left)
+			image_hash_stop(w->hash);
+		w->pos += w->chunk_left;
+		next_chunk(w);
+		break;
+	case CHUNK_TYPE_CRC32:
+		if (payload != sizeof(uint32_t))
+			goto bad_size;
+		expect(w, IW_CHUNK_CRC, sizeof(uint32_t));
+		break;
+	default:
+		pr_error("unknown sparse chunk type 0x%x\n", ch.chunk_type);
+		return -1;
+	}
+	return 0;
+
+bad_size:
+	pr_error("bad size for sparse chunk type 0x%x\n", ch.chunk_type);
+	return -1;
+}
+
+
+static int process(struct imgwriter *w, const unsigned char *data, size_t len)
+{
+	uint32_t magic;
+	size_t n;
+
+	while (len) {
+		if (w->skip) {
+			n = min((uint64_t)len, w->skip);
+			w->skip -= n;
+			data += n;
+			len -= n;
+			continue;
+		}
+
+		switch (w->state) {
+		case IW_MAGIC:
+			if (!collect(w, &data, &len))
+				break;
+			memcpy(&magic, w->hdr, sizeof(magic));
+			if (magic == SPARSE_HEADER_MAGIC) {
+				/* keep the magic, it's part of the header */
+				w->state = IW_SPARSE_HDR;
+				w->hdr_need = SPARSE_HEADER_LEN;
+				break;
+			}
+			pr_debug("Streaming raw image to %s\n", w->device);
+			w->state = IW_RAW;
+			if (output(w, w->hdr, w->hdr_len))
+				return -1;
+			break;
+		case IW_RAW:
+			if (output(w, data, len))
+				return -1;
+			len = 0;
+			break;
+		case IW_SPARSE_HDR:
+			if (collect(w, &data, &len) && start_sparse(w))
+				return -1;
+			break;
+		case IW_CHUNK_HDR:
+			if (collect(w, &data, &len) && start_chunk(w))
+				return -1;
+			break;
+		case IW_CHUNK_DATA:
+			n = min((uint64_t)len, w->chunk_left);
+			if (output(w, data, n))
+				return -1;
+			if (w->check_crc)
+				w->crc = crc32(w->crc, data, n);
+			data += n;
+			len -= n;
+			w->chunk_left -= n;
+			if (!w->chunk_left)
+				next_chunk(w);
+			break;
+		case IW_CHUNK_FILL:
+			if (!collect(w, &data, &len))
+				break;
+			memcpy(&magic, w->hdr, sizeof(magic));
+			if (output_fill(w, magic, w->chunk_left))
+				return -1;
+			next_chunk(w);
+			break;
+		case IW_CHUNK_CRC:
+			if (!collect(w, &data, &len))
+				break;
+			memcpy(&magic, w->hdr, sizeof(magic));
+			if (w->check_crc && magic != w->crc) {
+				pr_error("sparse image CRC mismatch: 0x%08x, expected 0x%08x\n",
+						w->crc, magic);
+				return -1;
+			}
+			next_chunk(w);
+			break;
+		case IW_DONE:
+			pr_error("trailing data after end of sparse image\n");
+			return -1;
+		case IW_ERROR:
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+int imgwriter_write(struct imgwriter *w, const void *data, size_t len)
+{
+	if (process(w, data, len)) {
+		w->state = IW_ERROR;
+		return -1;
+	}
+	return 0;
+}
+
+
+uint64_t imgwriter_bytes_done(struct imgwriter *w)
+{
+	return blkio_bytes_done(w->io);
+}
+
+
+int imgwriter_close(struct imgwriter *w, bool sync)
+{
+	int ret = -1;
+
+	switch (w->state) {
+	case IW_MAGIC:
+		/* Image shorter than the sparse magic */
+		if (output(w, w->hdr, w->hdr_len))
+			break;
+		/* fall through */
+	case IW_RAW:
+	case IW_DONE:
+		ret = 0;
+		break;
+	case IW_ERROR:
+		break;
+	default:
+		pr_error("sparse image truncated\n");
+		break;
+	}
+
+	if (flush(w))
+		ret = -1;
+	if (blkio_close(w->io, sync))
+		ret = -1;
+	close(w->fd);
+	pr_debug("wrote %" PRIu64 " bytes to %s\n", w->pos, w->device);
+
+	free(w->device);
+	free(w);
+	return ret;
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
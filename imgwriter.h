@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USERFASTBOOT_IMGWRITER_H_
+#define _USERFASTBOOT_IMGWRITER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blkio.h"
+
+/* Writes a raw or Android sparse image to a block device as it arrives,
+ * in arbitrarily sized pieces. The image type is detected from the
+ * first bytes fed in. */
+struct imgwriter;
+
+/* mode and flags are passed on to blkio_open_mode() */
+struct imgwriter *imgwriter_open(const char *device, uint64_t devsize,
+		enum blkio_mode mode, unsigned flags);
+
+/* Feed the next len bytes of the image. Returns 0 on success, -1 if the
+ * image is malformed, doesn't fit, or couldn't be written. Once this
+ * fails, all further calls fail too. */
+int imgwriter_write(struct imgwriter *w, const void *data, size_t len);
+
+/* Check the running CRC32 of the output against the CRC32 chunks of a
+ * sparse image, if it has any. Call before the first write. */
+void imgwriter_check_crc(struct imgwriter *w);
+
+/* Feed the expanded image to h as it is written, see hashes.h. Call
+ * before the first write; h remains owned by the caller. */
+struct image_hash;
+void imgwriter_set_hash(struct imgwriter *w, struct image_hash *h);
+
+/* Bytes of output known to be on the device, see blkio_bytes_done() */
+uint64_t imgwriter_bytes_done(struct imgwriter *w);
+
+/* Check that a complete image was received, write out what is left and
+ * free the writer. With sync, also wait for it to be on the device.
+ * Returns 0 on success. */
+int imgwriter_close(struct imgwriter *w, bool sync);
+
+#endif
@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* A flash manifest runs a whole provisioning sequence from a single
+ * download, saving a USB round trip and host latency per step. The
+ * download starts with the manifest text, terminated by a NUL byte or
+ * the end of the download, followed by any image data the steps use.
+ * Each line of text is one fastboot command, optionally preceded by the
+ * location of the image it operates on within the download:
+ *
+ *	# comment
+ *	@0x1000+0x200 flash:gpt
+ *	erase:cache
+ *	@0x1200+0x3f000000 flash:system
+ *	oem setvar foo bar
+ *	reboot
+ *
+ * All steps are validated before any is run. They are then executed in
+ * order, stopping at the first failure, with one INFO sent per step.
+ * A reboot, if any, must be the last step. */
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/hashmap.h>
+
+#include "manifest.h"
+#include "fastboot.h"
+#include "userfastboot_util.h"
+#include "userfastboot_ui.h"
+
+/* Longest command the host could have sent us directly */
+#define MAX_COMMAND_LEN		64
+#define MAX_RESPONSE_LEN	64
+
+struct manifest_step {
+	char *command;
+	void *data;
+	unsigned sz;
+};
+
+struct manifest {
+	struct manifest_step *steps;
+	unsigned count;
+	unsigned alloc;
+};
+
+static bool is_reboot(const char *command)
+{
+	return !strncmp(command, "reboot", strlen("reboot")) ||
+		!strncmp(command, "oem reboot", strlen("oem reboot")) ||
+		!strcmp(command, "continue");
+}
+
+static int parse_blob(char *spec, unsigned char *data, unsigned sz,
+		struct manifest_step *step)
+{
+	char *plus, *end;
+	uint64_t offset, length;
+
+	plus = strchr(spec, '+');
+	if (!plus)
+		return -1;
+	*plus = '\0';
+
+	offset = strtoull(spec, &end, 0);
+	if (end == spec || *end)
+		return -1;
+	length = strtoull(plus + 1, &end, 0);
+	if (end == plus + 1 || *end)
+		return -1;
+
+	if (offset > sz || length > sz - offset) {
+		pr_error("image @%s+%s is outside the download\n", spec,
+				plus + 1);
+		return -1;
+	}
+	step->data = length ? data + offset : NULL;
+	step->sz = length;
+	return 0;
+}
+
+static int add_step(struct manifest *m, char *line, unsigned char *data,
+		unsigned sz)
+{
+	struct manifest_step step;
+	char *command = line;
+
+	memset(&step, 0, sizeof(step));
+
+	if (*line == '@') {
+		command = line + 1;
+		while (*command && !isspace(*command))
+			command++;
+		if (*command)
+			*command++ = '\0';
+		while (isspace(*command))
+			command++;
+
+		if (parse_blob(line + 1, data, sz, &step)) {
+			pr_error("bad image location in manifest: %s\n", line);
+			return -1;
+		}
+	}
+
+	if (!*command) {
+		pr_error("manifest step without a command\n");
+		return -1;
+	}
+	if (strlen(command) > MAX_COMMAND_LEN) {
+		pr_error("manifest command too long: %s\n", command);
+		return -1;
+	}
+
+	if (m->count == m->alloc) {
+		struct manifest_step *steps;
+
+		m->alloc = m->alloc ? m->alloc * 2 : 16;
+		steps = realloc(m->steps, m->alloc * sizeof(*steps));
+		if (!steps)
+			die();
+		m->steps = steps;
+	}
+	step.command = command;
+	m->steps[m->count++] = step;
+	return 0;
+}
+
+static int parse_manifest(struct manifest *m, char *text,
+		unsigned char *data, unsigned sz)
+{
+	char *line, *saveptr, *end;
+	unsigned i;
+
+	for (line = strtok_r(text, "\n", &saveptr); line;
+			line = strtok_r(NULL, "\n", &saveptr)) {
+		while (isspace(*line))
+			line++;
+		end = line + strlen(line);
+		while (end > line && isspace(end[-1]))
+			*--end = '\0';
+
+		if (!*line || *line == '#')
+			continue;
+
+		if (add_step(m, line, data, sz))
+			return -1;
+	}
+
+	if (!m->count) {
+		pr_error("empty manifest\n");
+		return -1;
+	}
+
+	/* Nothing after a reboot would ever run */
+	for (i = 0; i + 1 < m->count; i++) {
+		if (is_reboot(m->steps[i].command)) {
+			pr_error("'%s' must be the last manifest step\n",
+					m->steps[i].command);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int cmd_flash_manifest(Hashmap *params, int fd, void *data, unsigned sz)
+{
+	struct manifest m;
+	char response[MAX_RESPONSE_LEN];
+	char *text;
+	size_t text_len;
+	unsigned i;
+	int ret = -1;
+
+	if (!data) {
+		pr_error("No manifest downloaded\n");
+		return -1;
+	}
+
+	memset(&m, 0, sizeof(m));
+	text_len = strnlen(data, sz);
+	text = xmalloc(text_len + 1);
+	memcpy(text, data, text_len);
+	text[text_len] = '\0';
+
+	if (parse_manifest(&m, text, data, sz))
+		goto out;
+
+	pr_info("Running %u step flash manifest\n", m.count);
+	for (i = 0; i < m.count; i++) {
+		struct manifest_step *step = &m.steps[i];
+
+		pr_status("Manifest step %u/%u: %s\n", i + 1, m.count,
+				step->command);
+
+		/* Reboots don't come back, so report the manifest as done
+		 * first. Nothing more reaches the host after that, our
+		 * caller's own response included */
+		if (is_reboot(step->command)) {
+			fastboot_info("[%u/%u] %s", i + 1, m.count,
+					step->command);
+			fastboot_okay("");
+			fastboot_run_command(step->command, step->data,
+					step->sz, response, sizeof(response));
+			pr_error("manifest step '%s' returned: %s\n",
+					step->command, response);
+			goto out;
+		}
+
+		if (fastboot_run_command(step->command, step->data, step->sz,
+					response, sizeof(response))) {
+			pr_error("manifest step '%s' failed: %s\n",
+					step->command, response);
+			fastboot_info("[%u/%u] %s: %s", i + 1, m.count,
+					step->command, response);
+			goto out;
+		}
+		fastboot_info("[%u/%u] %s: %s", i + 1, m.count, step->command,
+				response);
+	}
+	ret = 0;
+out:
+	free(m.steps);
+	free(text);
+	return ret;
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
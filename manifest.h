@@ -0,0 +1,8 @@
+#ifndef USERFASTBOOT_MANIFEST_H
+#define USERFASTBOOT_MANIFEST_H
+
+#include <cutils/hashmap.h>
+
+int cmd_flash_manifest(Hashmap *params, int fd, void *data, unsigned sz);
+
+#endif
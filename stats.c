@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "stats.h"
+#include "userfastboot_util.h"
+
+#define NS_PER_MS	((uint64_t)1000000)
+#define NS_PER_SEC	((uint64_t)1000000000)
+
+/* Histogram bucket upper bounds, the last bucket takes everything else.
+ * Values have to stay short, a getvar reply only has 60 characters */
+static const uint64_t latency_bounds_ms[] = {
+	1, 10, 100, 1000, 10000, 100000
+};
+#define LATENCY_BUCKETS	(sizeof(latency_bounds_ms) / sizeof(uint64_t) + 1)
+
+static const uint64_t throughput_bounds_mibps[] = {
+	1, 5, 10, 20, 40, 80, 160
+};
+#define THROUGHPUT_BUCKETS \
+	(sizeof(throughput_bounds_mibps) / sizeof(uint64_t) + 1)
+
+static struct {
+	uint64_t counters[STATS_NR_COUNTERS];
+
+	uint64_t commands;
+	uint64_t latency_max_ns;
+	uint64_t latency_hist[LATENCY_BUCKETS];
+
+	uint64_t downloads;
+	uint64_t download_bytes;
+	uint64_t download_ns;
+	uint64_t last_download_kibps;
+	uint64_t throughput_hist[THROUGHPUT_BUCKETS];
+} stats;
+
+static const char *counter_names[STATS_NR_COUNTERS] = {
+	[STATS_RX_BYTES] = "stats-rx-bytes",
+	[STATS_TX_BYTES] = "stats-tx-bytes",
+	[STATS_READ_NS] = "stats-usb-read-ms",
+	[STATS_WRITE_NS] = "stats-usb-write-ms",
+	[STATS_SINK_NS] = "stats-disk-write-ms",
+	[STATS_RING_EMPTY_NS] = "stats-wait-usb-ms",
+	[STATS_RING_FULL_NS] = "stats-wait-disk-ms",
+};
+
+
+static inline void add(uint64_t *counter, uint64_t val)
+{
+	__atomic_add_fetch(counter, val, __ATOMIC_RELAXED);
+}
+
+
+static inline uint64_t get(uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+
+static unsigned bucket(const uint64_t *bounds, unsigned count, uint64_t val)
+{
+	unsigned i;
+
+	for (i = 0; i < count; i++)
+		if (val < bounds[i])
+			break;
+	return i;
+}
+
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+
+void stats_add(enum stats_counter c, uint64_t val)
+{
+	add(&stats.counters[c], val);
+}
+
+
+void stats_add_since(enum stats_counter c, uint64_t start)
+{
+	add(&stats.counters[c], stats_now() - start);
+}
+
+
+void stats_command_done(uint64_t start)
+{
+	uint64_t ns = stats_now() - start;
+	uint64_t max = get(&stats.latency_max_ns);
+
+	add(&stats.commands, 1);
+	add(&stats.latency_hist[bucket(latency_bounds_ms,
+			LATENCY_BUCKETS - 1, ns / NS_PER_MS)], 1);
+	while (ns > max && !__atomic_compare_exchange_n(&stats.latency_max_ns,
+				&max, ns, false, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED))
+		;
+}
+
+
+void stats_download_done(uint64_t bytes, uint64_t start)
+{
+	uint64_t ns = stats_now() - start;
+	uint64_t kibps;
+
+	if (!ns)
+		ns = 1;
+	kibps = bytes * NS_PER_SEC / 1024 / ns;
+
+	add(&stats.downloads, 1);
+	add(&stats.download_bytes, bytes);
+	add(&stats.download_ns, ns);
+	__atomic_store_n(&stats.last_download_kibps, kibps, __ATOMIC_RELAXED);
+	add(&stats.throughput_hist[bucket(throughput_bounds_mibps,
+			THROUGHPUT_BUCKETS - 1, kibps / 1024)], 1);
+}
+
+
+static char *format_list(const uint64_t *vals, unsigned count, bool atomic)
+{
+	char *str = xstrdup("");
+	char *next;
+	unsigned i;
+
+	for (i = 0; i < count; i++) {
+		uint64_t val = atomic ? get((uint64_t *)&vals[i]) : vals[i];
+
+		next = xasprintf("%s%s%" PRIu64, str, i ? "," : "", val);
+		free(str);
+		str = next;
+	}
+	return str;
+}
+
+
+static void emit(stats_var_cb cb, void *context, const char *name,
+		char *value)
+{
+	cb(name, value, context);
+	free(value);
+}
+
+
+void stats_foreach(stats_var_cb cb, void *context)
+{
+	uint64_t download_ns;
+	unsigned i;
+
+	for (i = 0; i < STATS_NR_COUNTERS; i++) {
+		uint64_t val = get(&stats.counters[i]);
+
+		if (i != STATS_RX_BYTES && i != STATS_TX_BYTES)
+			val /= NS_PER_MS;
+		emit(cb, context, counter_names[i],
+				xasprintf("%" PRIu64, val));
+	}
+
+	emit(cb, context, "stats-commands",
+			xasprintf("%" PRIu64, get(&stats.commands)));
+	emit(cb, context, "stats-cmd-latency-max-ms", xasprintf("%" PRIu64,
+			get(&stats.latency_max_ns) / NS_PER_MS));
+	emit(cb, context, "stats-cmd-latency-buckets-ms",
+			format_list(latency_bounds_ms, LATENCY_BUCKETS - 1,
+				false));
+	emit(cb, context, "stats-cmd-latency-hist",
+			format_list(stats.latency_hist, LATENCY_BUCKETS, true));
+
+	download_ns = get(&stats.download_ns);
+	emit(cb, context, "stats-downloads",
+			xasprintf("%" PRIu64, get(&stats.downloads)));
+	emit(cb, context, "stats-download-bytes",
+			xasprintf("%" PRIu64, get(&stats.download_bytes)));
+	emit(cb, context, "stats-download-avg-kibps", xasprintf("%" PRIu64,
+			download_ns ? get(&stats.download_bytes) *
+				(NS_PER_SEC / 1024) / download_ns : 0));
+	emit(cb, context, "stats-download-last-kibps", xasprintf("%" PRIu64,
+			get(&stats.last_download_kibps)));
+	emit(cb, context, "stats-download-buckets-mibps",
+			format_list(throughput_bounds_mibps,
+				THROUGHPUT_BUCKETS - 1, false));
+	emit(cb, context, "stats-download-hist",
+			format_list(stats.throughput_hist, THROUGHPUT_BUCKETS,
+				true));
+}
+
+
+struct lookup {
+	const char *name;
+	char *value;
+};
+
+static void lookup_cb(const char *name, const char *value, void *context)
+{
+	struct lookup *l = context;
+
+	if (!l->value && !strcmp(name, l->name))
+		l->value = xstrdup(value);
+}
+
+
+char *stats_getvar(const char *name)
+{
+	struct lookup l = { .name = name };
+
+	stats_foreach(lookup_cb, &l);
+	return l.value;
+}
+
+
+void stats_reset(void)
+{
+	/* Racing updates may survive the reset, which is harmless */
+	memset(&stats, 0, sizeof(stats));
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
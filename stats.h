@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USERFASTBOOT_STATS_H_
+#define _USERFASTBOOT_STATS_H_
+
+#include <stdint.h>
+
+/* Transport telemetry, served as stats-* fastboot variables. They are
+ * formatted when asked for rather than kept in the variable table,
+ * where every update would invalidate the getvar:all cache. All of
+ * these are safe to call from any thread. */
+enum stats_counter {
+	STATS_RX_BYTES,		/* received from the host */
+	STATS_TX_BYTES,		/* sent to the host */
+	STATS_READ_NS,		/* blocked waiting for data from the host */
+	STATS_WRITE_NS,		/* blocked sending to the host */
+	STATS_SINK_NS,		/* writing received data out to storage */
+	STATS_RING_EMPTY_NS,	/* data consumer idle, transport-bound */
+	STATS_RING_FULL_NS,	/* transport reader idle, storage-bound */
+	STATS_NR_COUNTERS
+};
+
+/* Monotonic clock, in nanoseconds */
+uint64_t stats_now(void);
+
+void stats_add(enum stats_counter c, uint64_t val);
+
+/* Account the time since start, as returned by stats_now() */
+void stats_add_since(enum stats_counter c, uint64_t start);
+
+/* A command was answered, start being when it was received */
+void stats_command_done(uint64_t start);
+
+/* A bulk transfer of bytes completed, start being when it began */
+void stats_download_done(uint64_t bytes, uint64_t start);
+
+/* Call cb with the name and current value of each stats-* variable */
+typedef void (*stats_var_cb)(const char *name, const char *value,
+		void *context);
+void stats_foreach(stats_var_cb cb, void *context);
+
+/* Current value of a stats-* variable, to be freed by the caller, or NULL
+ * if there is no such variable */
+char *stats_getvar(const char *name);
+
+void stats_reset(void);
+
+#endif
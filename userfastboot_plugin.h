@@ -26,6 +26,9 @@ enum device_state {
 	UNLOCKED = 2
 };
 
+/* fd reads the downloaded image from its start, data/sz map it. fd is -1
+ * if nothing was downloaded, or for a manifest step given only part of
+ * the download, which only has data/sz. */
 typedef int (*flash_func)(Hashmap *params, int fd, void *data, unsigned sz);
 
 #define MAX_OEM_ARGS 64
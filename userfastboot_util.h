@@ -9,7 +9,6 @@
 /* File I/O */
 int named_file_write(const char *filename, const unsigned char *what,
 		size_t sz, off_t offset, int append);
-int named_file_write_ext4_sparse(const char *filename, const char *what);
 
 /* Attribute specification and -Werror prevents most security shenanigans with
  * these functions */
@@ -41,7 +40,7 @@ void xstring_append_line(char **str, const char *fmt, ...) __attribute__ ((forma
 
 /* struct fstab_rec operations */
 int mount_partition(struct fstab_rec *vol, bool readonly);
-int erase_partition(struct fstab_rec *vol);
+int erase_partition(struct fstab_rec *vol, uint64_t *erased);
 int check_ext_superblock(struct fstab_rec *vol, int *sb_present);
 int unmount_partition(struct fstab_rec *vol);
 int get_volume_size(struct fstab_rec *vol, uint64_t *sz);
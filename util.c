@@ -30,11 +30,13 @@
  */
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <stdarg.h>
@@ -47,17 +49,12 @@
 #include <cutils/android_reboot.h>
 #include <bootloader.h>
 
-#include <sparse/sparse.h>
-#include "sparse_file.h"
-#include "output_file.h"
-#include "backed_block.h"
-#include "sparse_defs.h"
-#include "sparse_format.h"
-
 #include "fastboot.h"
 #include "userfastboot.h"
 #include "userfastboot_ui.h"
 #include "userfastboot_util.h"
+#include "blkio.h"
+#include "stats.h"
 #include "userfastboot_fstab.h"
 
 /* make_ext4fs.h can't be included along with linux/ext3_fs.h.
@@ -161,154 +158,15 @@ ssize_t robust_write(int fd, const void *buf, size_t count)
 }
 
 
-static void sparse_file_write_block(struct output_file *out,
-		struct backed_block *bb)
-{
-	switch (backed_block_type(bb)) {
-	case BACKED_BLOCK_DATA:
-		write_data_chunk(out, backed_block_len(bb), backed_block_data(bb));
-		break;
-	case BACKED_BLOCK_FILE:
-		write_file_chunk(out, backed_block_len(bb),
-				backed_block_filename(bb), backed_block_file_offset(bb));
-		break;
-	case BACKED_BLOCK_FD:
-		write_fd_chunk(out, backed_block_len(bb),
-				backed_block_fd(bb), backed_block_file_offset(bb));
-		break;
-	case BACKED_BLOCK_FILL:
-		write_fill_chunk(out, backed_block_len(bb),
-				backed_block_fill_val(bb));
-		break;
-	}
-}
-
-static unsigned int sparse_count_chunks(struct sparse_file *s)
-{
-	struct backed_block *bb;
-	unsigned int last_block = 0;
-	unsigned int chunks = 0;
-
-	for (bb = backed_block_iter_new(s->backed_block_list); bb;
-			bb = backed_block_iter_next(bb)) {
-		if (backed_block_block(bb) > last_block) {
-			/* If there is a gap between chunks, add a skip chunk */
-			chunks++;
-		}
-		chunks++;
-		last_block = backed_block_block(bb) +
-				DIV_ROUND_UP(backed_block_len(bb), s->block_size);
-	}
-	if (last_block < DIV_ROUND_UP(s->len, s->block_size)) {
-		chunks++;
-	}
-
-	return chunks;
-}
-
-static int write_all_blocks(struct sparse_file *s, struct output_file *out)
-{
-	struct backed_block *bb;
-	unsigned int last_block = 0;
-	int64_t pad;
-	unsigned int total_blocks = 0;
-	unsigned int count = 0;
-
-	for (bb = backed_block_iter_new(s->backed_block_list); bb;
-			bb = backed_block_iter_next(bb))
-		total_blocks++;
-
-	mui_show_progress(1.0, 0);
-
-	for (bb = backed_block_iter_new(s->backed_block_list); bb;
-			bb = backed_block_iter_next(bb)) {
-		mui_set_progress((float)count / (float)total_blocks);
-		if (backed_block_block(bb) > last_block) {
-			unsigned int blocks = backed_block_block(bb) - last_block;
-			write_skip_chunk(out, (int64_t)blocks * s->block_size);
-		}
-		sparse_file_write_block(out, bb);
-		last_block = backed_block_block(bb) +
-				DIV_ROUND_UP(backed_block_len(bb), s->block_size);
-		count++;
-	}
-
-	mui_reset_progress();
-	pad = s->len - (int64_t)last_block * s->block_size;
-	if (pad < 0) {
-		return -1;
-	}
-	if (pad > 0) {
-		write_skip_chunk(out, pad);
-	}
-
-	return 0;
-}
-
-int named_file_write_ext4_sparse(const char *filename, const char *what)
-{
-	int infd = -1;
-	int outfd = -1;
-	int ret = -1;
-	struct sparse_file *s;
-	int chunks;
-	struct output_file *out;
-
-	outfd = open(filename, O_WRONLY);
-	if (outfd < 0) {
-		pr_error("Coudln't open destination file %s\n", filename);
-		goto out;
-	}
-	infd = open(what, O_RDONLY);
-	if (infd < 0) {
-		pr_error("Couldn't open sparse input file\n");
-		goto out;
-	}
-
-	pr_verbose("Importing sparse file data\n");
-	s = sparse_file_import(infd, true, false);
-	if (!s) {
-		pr_error("Couldn't import sparse file data\n");
-		goto out;
-	}
-
-	pr_verbose("Writing sparse file data\n");
-
-	chunks = sparse_count_chunks(s);
-	out = output_file_open_fd(outfd, s->block_size, s->len,
-			false, false, chunks, false);
-	if (!out)
-		die_errno("malloc");
-
-	ret = write_all_blocks(s, out);
-	output_file_close(out);
-
-	if (ret < 0)
-		pr_error("Couldn't write output file");
-	else
-		ret = 0;
-
-	pr_verbose("Destroying sparse data stucture\n");
-	sparse_file_destroy(s);
-	fsync(outfd);
-out:
-	if (infd >= 0)
-		close(infd);
-	if (outfd >= 0)
-		close(outfd);
-
-	return ret;
-}
-
-
 int named_file_write(const char *filename, const unsigned char *what,
 		size_t sz, off_t offset, int append)
 {
 	int fd, ret, flags;
-	size_t sz_orig = sz;
 	size_t count = 0;
+	struct blkio *io;
 
-	flags = O_RDWR | (append ? O_APPEND : (O_CREAT | O_TRUNC));
+	/* pwrite() ignores the offset with O_APPEND, find the end instead */
+	flags = O_RDWR | (append ? 0 : (O_CREAT | O_TRUNC));
 	if (flags & O_CREAT)
 		fd = open(filename, flags, 0600);
 	else
@@ -318,8 +176,9 @@ int named_file_write(const char *filename, const unsigned char *what,
 				filename, strerror(errno));
 		return -1;
 	}
-	if (offset) {
-		if (lseek(fd, offset, SEEK_SET) < 0) {
+	if (append) {
+		offset = lseek(fd, 0, SEEK_END);
+		if (offset < 0) {
 			pr_perror("lseek");
 			close(fd);
 			return -1;
@@ -329,28 +188,23 @@ int named_file_write(const char *filename, const unsigned char *what,
 	mui_show_progress(1.0, 0);
 	pr_verbose("write() %zu bytes to %s\n", sz, filename);
 
-	while (sz) {
-		mui_set_progress((float)count / (float)sz_orig);
+	io = blkio_open(fd, 0);
+	while (count < sz) {
+		size_t chunk = min(sz - count, (size_t)BLKIO_BUF_SIZE);
 
-		ret = write(fd, what, min(sz, 1024U * 1024U));
-		if (ret < 0) {
-			if (errno != EINTR) {
-				mui_reset_progress();
-				pr_error("file_write: Failed to write to %s: %s\n",
-					filename, strerror(errno));
-				close(fd);
-				return -1;
-			} else {
-				continue;
-			}
-		}
-		what += ret;
-		sz -= ret;
-		count += ret;
+		mui_set_progress((float)count / (float)sz);
+		if (blkio_write_external(io, what + count, chunk,
+					(uint64_t)offset + count))
+			break;
+		count += chunk;
 	}
-	fsync(fd);
+	ret = blkio_close(io, true);
 	close(fd);
 	mui_reset_progress();
+	if (ret) {
+		pr_error("file_write: Failed to write to %s\n", filename);
+		return -1;
+	}
 	return 0;
 }
 
@@ -534,41 +388,65 @@ enum erase_type {
 	ZERO
 };
 
-/* more or less arbitrary value */
-#define ZEROES_ARRAY_SZ	4096U
+static const char *erase_type_names[] = {
+	[SECDISCARD] = "secdiscard",
+	[DISCARD] = "discard",
+	[ZERO] = "zero",
+};
 
-static int erase_range_zero(int fd, uint64_t start, uint64_t len)
-{
-	char zeroes[ZEROES_ARRAY_SZ];
+/* What a disk supports for erasing, probed the first time one of its
+ * partitions gets erased. etype is the fastest method known to work on
+ * it, and only degrades when that fails on the same disk. Erases may run
+ * in the background, so the list, etype, probed and chunk are only
+ * touched under erase_caps_lock; the rest is fixed once created. */
+struct erase_caps {
+	char *sysfs;
+	const char *name;
+	enum erase_type etype;
+	bool probing;		/* by an erase that dropped the lock */
+	bool probed;
+	int64_t discard_granularity;
+	int64_t discard_max_bytes;
+	int64_t write_zeroes_max_bytes;
+	int64_t chunk;		/* last size picked by next_chunk() */
+	struct erase_caps *next;
+};
 
-	memset(zeroes, 0, ZEROES_ARRAY_SZ);
+static struct erase_caps *erase_caps_list;
+static pthread_mutex_t erase_caps_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t erase_caps_probed = PTHREAD_COND_INITIALIZER;
 
-	if (lseek64(fd, start, SEEK_SET) < 0) {
-		pr_perror("lseek64");
-		return -1;
-	}
+static enum erase_type get_erase_type(struct erase_caps *caps)
+{
+	enum erase_type etype;
 
-	while (len) {
-		ssize_t ret;
+	pthread_mutex_lock(&erase_caps_lock);
+	etype = caps->etype;
+	pthread_mutex_unlock(&erase_caps_lock);
+	return etype;
+}
 
-		ret = write(fd, zeroes, min(len, ZEROES_ARRAY_SZ));
-		if (ret < 0) {
-			pr_perror("write");
-			return -1;
-		}
-		len -= ret;
-	}
-	return 0;
+/* Called with erase_caps_lock held */
+static void set_erase_type(struct erase_caps *caps, enum erase_type etype)
+{
+	const char *method = erase_type_names[etype];
+	char var[64];
+
+	caps->etype = etype;
+	if (etype == ZERO && caps->write_zeroes_max_bytes != 0)
+		method = "zeroout";
+	snprintf(var, sizeof(var), "erase-method:%s", caps->name);
+	fastboot_publish(var, xstrdup(method));
 }
 
-static int erase_range(int fd, uint64_t start, uint64_t len)
+static int erase_range(int fd, struct erase_caps *caps, uint64_t start,
+		uint64_t len)
 {
 	uint64_t range[2];
 	int ret;
-	static enum erase_type etype = SECDISCARD;
 
 	pr_debug("erasing offset %" PRIu64 " len %" PRIu64 "\n", start, len);
-	switch (etype) {
+	switch (get_erase_type(caps)) {
 	case SECDISCARD:
 		range[0] = start;
 		range[1] = len;
@@ -576,9 +454,12 @@ static int erase_range(int fd, uint64_t start, uint64_t len)
 		ret = ioctl(fd, BLKSECDISCARD, &range);
 		if (ret >= 0)
 			break;
-		pr_info("BLKSECDISCARD didn't work (%s), trying BLKDISCARD\n",
-				strerror(errno));
-		etype = DISCARD;
+		pr_info("%s: BLKSECDISCARD didn't work (%s), trying BLKDISCARD\n",
+				caps->name, strerror(errno));
+		pthread_mutex_lock(&erase_caps_lock);
+		if (caps->etype < DISCARD)
+			set_erase_type(caps, DISCARD);
+		pthread_mutex_unlock(&erase_caps_lock);
 		/* fall through */
 	case DISCARD:
 		range[0] = start;
@@ -587,40 +468,164 @@ static int erase_range(int fd, uint64_t start, uint64_t len)
 		ret = ioctl(fd, BLKDISCARD, &range);
 		if (ret >= 0)
 			break;
-		pr_info("BLKDISCARD didn't work (%s), fall back to zeroing out\n",
-				strerror(errno));
-		pr_info("This can take a LONG time!\n");
-		etype = ZERO;
+		pr_info("%s: BLKDISCARD didn't work (%s), fall back to zeroing out\n",
+				caps->name, strerror(errno));
+		pthread_mutex_lock(&erase_caps_lock);
+		if (caps->etype < ZERO)
+			set_erase_type(caps, ZERO);
+		pthread_mutex_unlock(&erase_caps_lock);
 		/* Fall through */
 	case ZERO:
-		return erase_range_zero(fd, start, len);
+		return blkio_zero_fill(fd, start, len);
 	}
 
 	return 0;
 }
 
+/* The sysfs directory of the whole disk a block device node is on */
 static char *get_disk_sysfs(char *node)
 {
 	struct stat sb;
+	char *path, *disk;
+
 	if (stat(node, &sb)) {
 		pr_perror("stat");
 		return NULL;
 	}
 
-	return xasprintf("/sys/dev/block/%d:0/", major(sb.st_rdev));
+	path = xasprintf("/sys/dev/block/%u:%u", major(sb.st_rdev),
+			minor(sb.st_rdev));
+	disk = realpath(path, NULL);
+	free(path);
+	if (!disk) {
+		pr_perror("realpath");
+		return NULL;
+	}
+	/* Partitions are subdirectories of their disk */
+	path = xasprintf("%s/partition", disk);
+	if (!access(path, F_OK))
+		*strrchr(disk, '/') = '\0';
+	free(path);
+	return disk;
+}
+
+static struct erase_caps *get_erase_caps(char *node)
+{
+	struct erase_caps *caps;
+	char *disk;
+
+	disk = get_disk_sysfs(node);
+	if (!disk)
+		return NULL;
+	for (caps = erase_caps_list; caps; caps = caps->next) {
+		if (!strcmp(caps->sysfs, disk)) {
+			free(disk);
+			return caps;
+		}
+	}
+
+	caps = xmalloc(sizeof(*caps));
+	memset(caps, 0, sizeof(*caps));
+	caps->sysfs = disk;
+	caps->name = strrchr(disk, '/') + 1;
+	if (read_sysfs_int64(&caps->discard_max_bytes,
+				"%s/queue/discard_max_bytes", disk)) {
+		pr_error("Couldn't read %s/queue/discard_max_bytes, is kernel configured correctly?\n",
+				disk);
+		caps->discard_max_bytes = 0;
+	}
+	if (read_sysfs_int64(&caps->discard_granularity,
+				"%s/queue/discard_granularity", disk))
+		caps->discard_granularity = 0;
+	/* Older kernels don't say, BLKZEROOUT gets tried anyway */
+	if (read_sysfs_int64(&caps->write_zeroes_max_bytes,
+				"%s/queue/write_zeroes_max_bytes", disk))
+		caps->write_zeroes_max_bytes = -1;
+	pr_debug("%s: discard max %" PRId64 " granularity %" PRId64
+			", write zeroes max %" PRId64 "\n", caps->name,
+			caps->discard_max_bytes, caps->discard_granularity,
+			caps->write_zeroes_max_bytes);
+
+	/* Secure discard has no queue attribute, only trying it tells */
+	caps->etype = caps->discard_max_bytes > 0 ? SECDISCARD : ZERO;
+	caps->next = erase_caps_list;
+	erase_caps_list = caps;
+	return caps;
+}
+
+/* Find the fastest method that works, starting from etype, by trying it
+ * on one discard granule at the start of the partition, which is about
+ * to be erased anyway. A secure discard can take seconds, so this runs
+ * without erase_caps_lock. */
+static enum erase_type probe_erase(int fd, struct erase_caps *caps,
+		enum erase_type etype, uint64_t len)
+{
+	uint64_t range[2];
+
+	range[0] = 0;
+	range[1] = min(len, (uint64_t)max(caps->discard_granularity,
+				(int64_t)BLKIO_ALIGN));
+	while (range[1] && etype != ZERO) {
+		if (!ioctl(fd, etype == SECDISCARD ? BLKSECDISCARD :
+					BLKDISCARD, &range))
+			break;
+		pr_info("%s: %s didn't work (%s)\n", caps->name,
+				erase_type_names[etype], strerror(errno));
+		etype++;
+	}
+	pr_info("%s: erasing with %s\n", caps->name, erase_type_names[etype]);
+	return etype;
 }
 
 #define MAX_INCREMENT 5LL * 1024LL * 1024LL * 1024LL
 
-int erase_partition(struct fstab_rec *vol)
+/* First range erased on a disk, before there is any timing to go by */
+#define FIRST_INCREMENT (128LL * 1024LL * 1024LL)
+
+/* How long each erase call should take. Long enough for the setup cost
+ * of each call not to matter, short enough for the progress bar to
+ * move. */
+#define ERASE_TARGET_MIN_NS	(1000ULL * 1000 * 1000)
+#define ERASE_TARGET_MAX_NS	(2000ULL * 1000 * 1000)
+
+/* Size of the next range to erase, given how long the last one of chunk
+ * bytes took */
+static int64_t next_chunk(struct erase_caps *caps, int64_t chunk,
+		uint64_t elapsed)
+{
+	int64_t align = BLKIO_ALIGN;
+	int64_t next;
+
+	if (elapsed >= ERASE_TARGET_MIN_NS && elapsed <= ERASE_TARGET_MAX_NS)
+		return chunk;
+
+	/* Aim for the middle, but don't overreact to one odd call */
+	elapsed = max(elapsed, (uint64_t)1);
+	next = (double)chunk * (ERASE_TARGET_MIN_NS + ERASE_TARGET_MAX_NS) /
+			2 / elapsed;
+	next = max(min(next, chunk * 4), chunk / 4);
+	next = min(next, MAX_INCREMENT);
+
+	/* Whole discard granules, anything else gets rounded off */
+	if (get_erase_type(caps) != ZERO && caps->discard_granularity > align)
+		align = caps->discard_granularity;
+	next -= next % align;
+	return max(next, align);
+}
+
+/* The range size adapts so that each erase call takes a second or two,
+ * see next_chunk(), and settles on the size the disk handles best. The
+ * bytes erased so far are added to erased, if not NULL, for the caller
+ * to show progress. */
+int erase_partition(struct fstab_rec *vol, uint64_t *erased)
 {
 	int64_t disk_size;
 	int fd;
 	int ret = -1;
 	int64_t increment;
 	int64_t pos;
-	int64_t max_bytes;
-	char *disk_name = NULL;
+	uint64_t start;
+	struct erase_caps *caps;
 
 	if (!is_valid_blkdev(vol->blk_device)) {
 		pr_error("invalid destination node. partition disks?\n");
@@ -633,53 +638,61 @@ int erase_partition(struct fstab_rec *vol)
 		return -1;
 	}
 
-	mui_show_indeterminate_progress();
-	/* It would be great if we could do BLKSECDISCARD on small regions
-	 * so that we can update the progress bar, but each of these ioctls
-	 * has a very long setup/teardown phase which makes the entire operation
-	 * much slower if we call multiple times on small areas */
-	disk_name = get_disk_sysfs(vol->blk_device);
-	if (!disk_name) {
-		pr_error("Couldn't get disk major number for %s\n", vol->blk_device);
-		goto out;
-	}
-
-	if (read_sysfs_int64(&max_bytes, "%s/queue/discard_max_bytes", disk_name)) {
-		pr_error("Couldn't read %s/queue/discard_max_bytes, is kernel configured correctly?\n",
-				disk_name);
-		pr_info("Fallback to manual zero of partition, this can take a LONG time\n");
-		ret = erase_range_zero(fd, 0, disk_size);
-		mui_show_text(0);
+	/* Other erases on the same disk wait for its probe, those on
+	 * other disks don't */
+	pthread_mutex_lock(&erase_caps_lock);
+	caps = get_erase_caps(vol->blk_device);
+	while (caps && caps->probing)
+		pthread_cond_wait(&erase_caps_probed, &erase_caps_lock);
+	if (caps && !caps->probed) {
+		enum erase_type etype = caps->etype;
+
+		caps->probing = true;
+		pthread_mutex_unlock(&erase_caps_lock);
+		etype = probe_erase(fd, caps, etype, disk_size);
+		pthread_mutex_lock(&erase_caps_lock);
+		caps->probing = false;
+		caps->probed = true;
+		set_erase_type(caps, etype);
+		pthread_cond_broadcast(&erase_caps_probed);
+	}
+	pthread_mutex_unlock(&erase_caps_lock);
+	if (!caps) {
+		pr_error("Couldn't find the disk of %s\n", vol->blk_device);
 		goto out;
 	}
-	pr_debug("max bytes: %" PRId64"\n", max_bytes);
 
-
-	if (max_bytes && disk_size > max_bytes)
-		increment = max_bytes;
-	else
-		increment = disk_size;
-
-	increment = min(increment, MAX_INCREMENT);
-
-	if (increment != disk_size)
-		mui_show_progress(1.0, 0);
+	/* Each BLKSECDISCARD has a very long setup/teardown phase, which
+	 * makes small ranges much slower overall, while huge ones leave the
+	 * progress bar stuck for minutes */
+	pthread_mutex_lock(&erase_caps_lock);
+	increment = caps->chunk ? caps->chunk : FIRST_INCREMENT;
+	pthread_mutex_unlock(&erase_caps_lock);
 
 	pos = 0;
 	while (pos < disk_size) {
-		mui_set_progress((float)pos / (float)disk_size);
-		if (pos + increment > disk_size)
-			increment = disk_size - pos;
-		if (erase_range(fd, pos, increment)) {
+		int64_t len = min(increment, disk_size - pos);
+
+		start = stats_now();
+		if (erase_range(fd, caps, pos, len)) {
 			pr_error("Disk erase operation failed\n");
 			goto out;
 		}
-		pos += increment;
-	}
+		pos += len;
+		if (erased)
+			__atomic_add_fetch(erased, len, __ATOMIC_RELAXED);
+		/* A short last range says nothing */
+		if (len == increment)
+			increment = next_chunk(caps, increment,
+					stats_now() - start);
+	}
+	pr_debug("%s: erased in ranges of %" PRId64 " bytes\n", caps->name,
+			increment);
+	pthread_mutex_lock(&erase_caps_lock);
+	caps->chunk = increment;
+	pthread_mutex_unlock(&erase_caps_lock);
 	ret = 0;
 out:
-	mui_reset_progress();
-	free(disk_name);
 	fsync(fd);
 	close(fd);
 	return ret;